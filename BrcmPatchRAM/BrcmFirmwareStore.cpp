@@ -34,6 +34,9 @@
 #include <libkern/zlib.h>
 #include <libkern/crypto/sha1.h>
 
+// Size classes of the zlib arena slots: inflate state (~7KB) and the 32KB window
+static const UInt32 kZlibArenaClassSizes[kBrcmZlibArenaClasses] = { 8 * 1024, 32 * 1024 };
+
 extern "C"
 {
     static void* z_alloc(void*, u_int items, u_int size);
@@ -47,14 +50,31 @@ extern "C"
     
     /*
      * Space allocation and freeing routines for use by zlib routines.
+     * Allocations are drawn from the store's arena (opaque) when a slot fits, otherwise from IOMalloc.
      */
-    void* z_alloc(void* notused __unused, u_int num_items, u_int size)
+    void* z_alloc(void* opaque, u_int num_items, u_int size)
     {
         void* result = NULL;
         z_mem* zmem = NULL;
         UInt32 total = num_items * size;
         UInt32 allocSize =  total + sizeof(zmem);
         
+        BrcmZlibArena* arena = (BrcmZlibArena*)opaque;
+        
+        if (arena)
+        {
+            arena->used += total;
+            
+            for (int i = 0; i < kBrcmZlibArenaClasses; i++)
+            {
+                if (!arena->slotUsed[i] && arena->slots[i] && total <= kZlibArenaClassSizes[i])
+                {
+                    arena->slotUsed[i] = true;
+                    return arena->slots[i];
+                }
+            }
+        }
+        
         zmem = (z_mem*)IOMalloc(allocSize);
         
         if (zmem)
@@ -66,232 +86,1027 @@ extern "C"
         return result;
     }
     
-    void z_free(void* notused __unused, void* ptr)
+    void z_free(void* opaque, void* ptr)
     {
+        BrcmZlibArena* arena = (BrcmZlibArena*)opaque;
+        
+        if (arena)
+        {
+            for (int i = 0; i < kBrcmZlibArenaClasses; i++)
+            {
+                if (ptr == arena->slots[i])
+                {
+                    arena->slotUsed[i] = false;
+                    return;
+                }
+            }
+        }
+        
         UInt32* skipper = (UInt32 *)ptr - 1;
         z_mem* zmem = (z_mem*)skipper;
         IOFree((void*)zmem, zmem->alloc_size);
     }
 };
 
+/**********************************************
+ * Patch stream construction
+ **********************************************/
+
 /*
- * Decompress the firmware using zlib inflate (If not compressed, return data normally)
+ * Collects instructions into a single patch stream, so parsed firmware is
+ * held in one allocation instead of an OSData object per instruction.
+ * The buffer is only allocated once the first instruction arrives.
  */
-OSData* BrcmFirmwareStore::decompressFirmware(OSData* firmware)
+class PatchStreamBuilder
 {
-    z_stream zstream;
-    int zlib_result;
-    int bufferSize = 0;
-    void* buffer = NULL;
-    OSData* result = NULL;
+private:
+    OSData* mData = NULL;
+    OSData* mIndex = NULL;
+    UInt32 mDataCapacity;
+    UInt32 mRecordCapacity;
+
+public:
+    PatchStreamBuilder(UInt32 dataCapacity, UInt32 recordCapacity)
+    {
+        mDataCapacity = dataCapacity;
+        mRecordCapacity = recordCapacity;
+    }
+
+    ~PatchStreamBuilder()
+    {
+        OSSafeReleaseNULL(mData);
+        OSSafeReleaseNULL(mIndex);
+    }
+
+    bool appendInstruction(const void* instruction, UInt32 length)
+    {
+        if (!mData)
+        {
+            // Reserve room for the header, the index is appended at the end
+            BrcmPatchStreamHeader header = {};
+            mData = OSData::withCapacity(sizeof(header) + mDataCapacity + mRecordCapacity * sizeof(UInt32));
+            mIndex = OSData::withCapacity(mRecordCapacity * sizeof(UInt32));
+            if (!mData || !mIndex || !mData->appendBytes(&header, sizeof(header)))
+                return false;
+        }
+
+        UInt32 offset = mData->getLength() - sizeof(BrcmPatchStreamHeader);
+        return mIndex->appendBytes(&offset, sizeof(offset)) && mData->appendBytes(instruction, length);
+    }
+
+    OSData* finish()
+    {
+        if (!mData)
+            return NULL;
+
+        BrcmPatchStreamHeader* header = (BrcmPatchStreamHeader*)mData->getBytesNoCopy();
+        header->magic = kBrcmPatchStreamMagic;
+        header->version = kBrcmPatchStreamVersion;
+        header->headerSize = sizeof(BrcmPatchStreamHeader);
+        header->recordCount = mIndex->getLength() / sizeof(UInt32);
+        header->dataSize = mData->getLength() - sizeof(BrcmPatchStreamHeader);
+
+        if (!mData->appendBytes(mIndex))
+            return NULL;
+
+        // Ownership of the stream moves to the caller
+        OSData* result = mData;
+        mData = NULL;
+        return result;
+    }
+};
+
+/**********************************************
+ * IntelHex firmware parsing
+ **********************************************/
+#define HEX_LINE_PREFIX ':'
+#define HEX_HEADER_SIZE 4
+
+#define REC_TYPE_DATA 0 // Data
+#define REC_TYPE_EOF 1  // End of File
+#define REC_TYPE_ESA 2  // Extended Segment Address
+#define REC_TYPE_SSA 3  // Start Segment Address
+#define REC_TYPE_ELA 4  // Extended Linear Address
+#define REC_TYPE_SLA 5  // Start Linear Address
+
+/*
+ * Validate if the current character is a valid hexadecimal character
+ */
+static inline bool validHexChar(UInt8 hex)
+{
+    return (hex >= 'a' && hex <= 'f') || (hex >= 'A' && hex <= 'F') || (hex >= '0' && hex <= '9');
+}
+
+/*
+ * Convert char '0-9,A-F' to hexadecimal values
+ */
+static inline void hex_nibble(UInt8 hex, UInt8 &output)
+{
+    output <<= 4;
+    
+    if (hex >= 'a')
+        output |= (0x0A + (hex - 'a')) & 0x0F;
+    if (hex >= 'A')
+        output |= (0x0A + (hex - 'A')) & 0x0F;
+    else
+        output |= (hex - '0') & 0x0F;
+}
+
+/*
+ * Two's complement checksum
+ */
+static char check_sum(const UInt8* data, UInt16 len)
+{
+    UInt32 crc = 0;
+    
+    for (int i = 0; i < len; i++)
+        crc += *(data + i);
+    
+    return (~crc + 1) & 0xFF;
+}
+
+/*
+ * Incremental IntelHex parser, fed with arbitrarily sized chunks of firmware data
+ */
+class IntelHexParser
+{
+private:
+    enum { kFirstLine, kLineData, kLineEnd, kEndOfFile, kInvalid } mState = kFirstLine;
+    PatchStreamBuilder mInstructions;
+    UInt32 mAddress = 0;
+    UInt8 mBinary[0x110];
+    UInt32 mNibbles = 0;
+
+    void startLine()
+    {
+        bzero(mBinary, sizeof(mBinary));
+        mNibbles = 0;
+        mState = kLineData;
+    }
+
+    bool parseRecord();
+
+public:
+    // Commands take roughly half the size of their hex lines
+    IntelHexParser(UInt32 sizeHint) : mInstructions(sizeHint / 2, sizeHint / 64) {}
+
+    bool parse(const UInt8* data, UInt32 length);
+    OSData* finish();
+};
+
+bool IntelHexParser::parseRecord()
+{
+    // Vendor Specific: Launch RAM
+    UInt8 HCI_VSC_LAUNCH_RAM[] = { 0x4c, 0xfc };
+    UInt8 instruction[0x110];
     
-    // Verify if the data is compressed
-    UInt16* magic = (UInt16*)firmware->getBytesNoCopy();
+    // Parse line data
+    UInt8 length = mBinary[0];
+    UInt16 addr = mBinary[1] << 8 | mBinary[2];
+    UInt8 record_type = mBinary[3];
+    UInt8 checksum = mBinary[HEX_HEADER_SIZE + length];
     
-    if (*magic != 0x0178     // Zlib no compression
-        && *magic != 0x9c78  // Zlib default compression
-        && *magic != 0xda78) // Zlib maximum compression
+    if (mNibbles & 1 || mNibbles / 2 < HEX_HEADER_SIZE + length + 1U)
     {
-        // Return the data as-is
-        firmware->retain();
-        return firmware;
+        DebugLog("parseFirmware - Invalid firmware, truncated record.\n");
+        goto exit_error;
     }
     
-    bufferSize = firmware->getLength() * 4;
+    if (checksum != (UInt8)check_sum(mBinary, HEX_HEADER_SIZE + length))
+    {
+        DebugLog("parseFirmware - Invalid firmware, checksum mismatch.\n");
+        goto exit_error;
+    }
     
-    buffer = IOMalloc(bufferSize);
+    mState = kLineEnd;
     
-    bzero(&zstream, sizeof(zstream));
+    // ParseFirmware class only supports I32HEX format
+    switch (record_type)
+    {
+        // Data
+        case REC_TYPE_DATA:
+        {
+            mAddress = (mAddress & 0xFFFF0000) | addr;
+            
+            // Reserved 4 bytes for the address
+            length += 4;
+            
+            // Build instruction (Opcode - 2 bytes, length - 1 byte)
+            memcpy(instruction, HCI_VSC_LAUNCH_RAM, sizeof(HCI_VSC_LAUNCH_RAM));
+            instruction[2] = length;
+            OSWriteLittleInt32(instruction, 3, mAddress);
+            memcpy(&instruction[7], &mBinary[4], length - 4);
+            
+            if (!mInstructions.appendInstruction(instruction, 3 + length))
+                goto exit_error;
+            break;
+        }
+        // End of File
+        case REC_TYPE_EOF:
+            mState = kEndOfFile;
+            break;
+        // Extended Segment Address
+        case REC_TYPE_ESA:
+            // Segment address multiplied by 16
+            mAddress = mBinary[4] << 8 | mBinary[5];
+            mAddress <<= 4;
+            break;
+            // Start Segment Address
+        case REC_TYPE_SSA:
+            // Set CS:IP register for 80x86
+            DebugLog("parseFirmware - Invalid firmware, unsupported start segment address instruction.\n");
+            goto exit_error;
+            // Extended Linear Address
+        case REC_TYPE_ELA:
+            // Set new higher 16 bits of the current address
+            mAddress = mBinary[4] << 24 | mBinary[5] << 16;
+            break;
+            // Start Linear Address
+        case REC_TYPE_SLA:
+            // Set EIP of 80386 and higher
+            DebugLog("parseFirmware - Invalid firmware, unsupported start linear address instruction.\n");
+            goto exit_error;
+        default:
+            DebugLog("parseFirmware - Invalid firmware, unknown record type encountered: 0x%02x.\n", record_type);
+            goto exit_error;
+    }
     
-    zstream.next_in   = (unsigned char*)firmware->getBytesNoCopy();
-    zstream.avail_in  = firmware->getLength();
+    return true;
     
-    zstream.next_out  = (unsigned char*)buffer;
-    zstream.avail_out = bufferSize;
+exit_error:
+    mState = kInvalid;
+    return false;
+}
+
+bool IntelHexParser::parse(const UInt8* data, UInt32 length)
+{
+    for (UInt32 i = 0; i < length && mState != kEndOfFile; i++)
+    {
+        UInt8 hex = data[i];
+        
+        switch (mState)
+        {
+            case kFirstLine:
+                if (hex != HEX_LINE_PREFIX)
+                {
+                    DebugLog("parseFirmware - Invalid firmware data.\n");
+                    mState = kInvalid;
+                    return false;
+                }
+                startLine();
+                break;
+                
+            case kLineData:
+                // Read all hex characters for this line
+                if (validHexChar(hex))
+                {
+                    if (mNibbles >= sizeof(mBinary) * 2)
+                    {
+                        DebugLog("parseFirmware - Invalid firmware, record too long.\n");
+                        mState = kInvalid;
+                        return false;
+                    }
+                    hex_nibble(hex, mBinary[mNibbles++ / 2]);
+                    break;
+                }
+                
+                if (!parseRecord())
+                    return false;
+                
+                if (mState == kLineEnd && hex == HEX_LINE_PREFIX)
+                    startLine();
+                break;
+                
+            case kLineEnd:
+                // Skip over any trailing newlines / whitespace
+                if (hex == HEX_LINE_PREFIX)
+                    startLine();
+                else if (validHexChar(hex))
+                {
+                    DebugLog("parseFirmware - Invalid firmware.\n");
+                    mState = kInvalid;
+                    return false;
+                }
+                break;
+                
+            case kEndOfFile:
+                break;
+                
+            case kInvalid:
+                return false;
+        }
+    }
+    
+    return mState != kInvalid;
+}
+
+OSData* IntelHexParser::finish()
+{
+    // Last record without trailing newline
+    if (mState == kLineData)
+        parseRecord();
+    
+    if (mState != kEndOfFile)
+    {
+        if (mState != kInvalid)
+            DebugLog("parseFirmware - Invalid firmware.\n");
+        return NULL;
+    }
+    
+    return mInstructions.finish();
+}
+
+/**********************************************
+ * Pre-compiled patch stream parsing
+ **********************************************/
+
+/*
+ * Check if the (decompressed) firmware is a pre-compiled patch stream
+ */
+static inline bool isPatchStream(OSData* firmwareData)
+{
+    if (firmwareData->getLength() < sizeof(BrcmPatchStreamHeader))
+        return false;
+
+    const BrcmPatchStreamHeader* header = (const BrcmPatchStreamHeader*)firmwareData->getBytesNoCopy();
+    return header->magic == kBrcmPatchStreamMagic;
+}
+
+OSData* BrcmFirmwareStore::parsePatchStream(OSData* firmwareData)
+{
+    const BrcmPatchStreamHeader* header = (const BrcmPatchStreamHeader*)firmwareData->getBytesNoCopy();
+    UInt32 length = firmwareData->getLength();
+
+    if (header->version != kBrcmPatchStreamVersion || header->headerSize < sizeof(BrcmPatchStreamHeader))
+    {
+        DebugLog("parsePatchStream - Unsupported patch stream version %d.\n", header->version);
+        return NULL;
+    }
+
+    // Header, command data and index must exactly fill the firmware
+    UInt64 expected = (UInt64)header->headerSize + header->dataSize + (UInt64)header->recordCount * sizeof(UInt32);
+    if (expected != length)
+    {
+        DebugLog("parsePatchStream - Invalid patch stream size (%d bytes, expected %llu).\n", length, expected);
+        return NULL;
+    }
+
+    const UInt8* data = (const UInt8*)header + header->headerSize;
+    const UInt8* index = data + header->dataSize;
+
+    for (UInt32 i = 0; i < header->recordCount; i++)
+    {
+        UInt32 offset = OSReadLittleInt32(index, i * sizeof(UInt32));
+        UInt32 end = i + 1 < header->recordCount ? OSReadLittleInt32(index, (i + 1) * sizeof(UInt32)) : header->dataSize;
+
+        // Each record is a complete HCI command: opcode (2 bytes), length (1 byte), parameters
+        if (end > header->dataSize || offset > end || end - offset < 3 || data[offset + 2] + 3U != end - offset)
+        {
+            DebugLog("parsePatchStream - Invalid record %d in patch stream.\n", i);
+            return NULL;
+        }
+    }
+
+    // A valid patch stream is used as instruction storage as-is
+    firmwareData->retain();
+    return firmwareData;
+}
+
+/**********************************************
+ * Streaming firmware decompression
+ **********************************************/
+#define INFLATE_CHUNK_SIZE 4096
+
+/*
+ * Check for a zlib header (no, default or maximum compression)
+ */
+static inline bool isCompressed(OSData* firmware)
+{
+    if (firmware->getLength() < sizeof(UInt16))
+        return false;
+
+    UInt16 magic = *(const UInt16*)firmware->getBytesNoCopy();
+    return magic == 0x0178 || magic == 0x9c78 || magic == 0xda78;
+}
+
+/*
+ * Receives (decompressed) firmware data chunk by chunk. IntelHex is parsed
+ * as it arrives, anything else is collected for patch stream validation.
+ */
+class FirmwareParser
+{
+private:
+    enum { kUnknown, kIntelHex, kPatchStream, kRaw } mFormat = kUnknown;
+    IntelHexParser mIntelHex;
+    OSData* mData = NULL;
+    UInt32 mSizeHint;
+    UInt32 mLength = 0;
+#ifdef DEBUG
+    SHA1_CTX mHash;
+#endif
+
+public:
+    // Raw parsers only collect the data, e.g. for delta base firmwares
+    FirmwareParser(UInt32 sizeHint, bool raw = false) : mIntelHex(raw ? 0 : sizeHint)
+    {
+        mSizeHint = sizeHint;
+        if (raw)
+            mFormat = kRaw;
+#ifdef DEBUG
+        SHA1Init(&mHash);
+#endif
+    }
+
+    ~FirmwareParser()
+    {
+        OSSafeReleaseNULL(mData);
+    }
+
+    UInt32 getLength() const { return mLength; }
+
+    bool parse(const UInt8* data, UInt32 length)
+    {
+        if (!length)
+            return true;
+
+        mLength += length;
+#ifdef DEBUG
+        SHA1Update(&mHash, data, length);
+#endif
+
+        if (mFormat == kUnknown)
+            mFormat = *data == HEX_LINE_PREFIX ? kIntelHex : kPatchStream;
+
+        if (mFormat == kIntelHex)
+            return mIntelHex.parse(data, length);
+
+        if (!mData && !(mData = OSData::withCapacity(mSizeHint)))
+            return false;
+        return mData->appendBytes(data, length);
+    }
+
+    /*
+     * Uncompressed patch streams are used without copying them
+     */
+    bool parse(OSData* firmwareData)
+    {
+        if ((mFormat == kUnknown && isPatchStream(firmwareData)) || (mFormat == kRaw && !mData))
+        {
+            if (mFormat == kUnknown)
+                mFormat = kPatchStream;
+            mLength = firmwareData->getLength();
+#ifdef DEBUG
+            SHA1Update(&mHash, firmwareData->getBytesNoCopy(), mLength);
+#endif
+            firmwareData->retain();
+            mData = firmwareData;
+            return true;
+        }
+
+        return parse((const UInt8*)firmwareData->getBytesNoCopy(), firmwareData->getLength());
+    }
+
+    /*
+     * Returns the parsed IntelHex instructions, the (unvalidated) patch stream or the raw data
+     */
+    OSData* finish(bool &patchStream)
+    {
+#ifdef DEBUG
+        uint8_t hash[SHA1_RESULTLEN];
+        SHA1Final(hash, &mHash);
+        DebugLog("Firmware SHA1: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\n",
+                 hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7], hash[8], hash[9],
+                 hash[10], hash[11], hash[12], hash[13], hash[14], hash[15], hash[16], hash[17], hash[18], hash[19]);
+#endif
+
+        patchStream = mFormat == kPatchStream;
+        if (mFormat == kIntelHex)
+            return mIntelHex.finish();
+
+        OSData* result = mData;
+        mData = NULL;
+        return result;
+    }
+};
+
+/*
+ * Check out a free zlib arena, NULL if all are in use (zlib then falls back to IOMalloc)
+ */
+BrcmZlibArena* BrcmFirmwareStore::acquireZlibArena()
+{
+    BrcmZlibArena* result = NULL;
+    
+    IOLockLock(mDataLock);
+    
+    for (int i = 0; i < kBrcmZlibArenaCount && !result; i++)
+    {
+        if (!mZlibArenas[i].busy && mZlibArenas[i].slots[0])
+        {
+            result = &mZlibArenas[i];
+            result->busy = true;
+            result->used = 0;
+        }
+    }
+    
+    IOLockUnlock(mDataLock);
+    
+    return result;
+}
+
+/*
+ * Reset the arena for the next load and track the workspace high-water mark
+ */
+void BrcmFirmwareStore::releaseZlibArena(BrcmZlibArena* arena)
+{
+    if (!arena)
+        return;
+    
+    IOLockLock(mDataLock);
+    
+    if (arena->used > mZlibArenaHighWater)
+    {
+        mZlibArenaHighWater = arena->used;
+        setProperty(kBrcmZlibArenaHighWater, mZlibArenaHighWater, 32);
+    }
+    
+    for (int i = 0; i < kBrcmZlibArenaClasses; i++)
+        arena->slotUsed[i] = false;
+    arena->busy = false;
+    
+    IOLockUnlock(mDataLock);
+}
+
+/*
+ * Decompress the firmware using zlib inflate, feeding the output to the parser in small chunks
+ */
+bool BrcmFirmwareStore::decompressFirmware(const void* data, UInt32 length, FirmwareParser &parser)
+{
+    z_stream zstream;
+    int zlib_result;
+    UInt8* buffer = (UInt8*)IOMalloc(INFLATE_CHUNK_SIZE);
+    
+    if (!buffer)
+        return false;
+    
+    bzero(&zstream, sizeof(zstream));
+    
+    zstream.next_in   = (unsigned char*)data;
+    zstream.avail_in  = length;
     
     zstream.zalloc    = z_alloc;
     zstream.zfree     = z_free;
+    zstream.opaque    = acquireZlibArena();
     
     zlib_result = inflateInit(&zstream);
     
     if (zlib_result != Z_OK)
     {
-        IOFree(buffer, bufferSize);
-        return NULL;
+        releaseZlibArena((BrcmZlibArena*)zstream.opaque);
+        IOFree(buffer, INFLATE_CHUNK_SIZE);
+        return false;
     }
     
-    zlib_result = inflate(&zstream, Z_FINISH);
-    
-    if (zlib_result == Z_STREAM_END || zlib_result == Z_OK)
-        // Allocate final result
-        result = OSData::withBytes(buffer, (unsigned int)zstream.total_out);
+    do
+    {
+        zstream.next_out  = buffer;
+        zstream.avail_out = INFLATE_CHUNK_SIZE;
+        
+        zlib_result = inflate(&zstream, Z_NO_FLUSH);
+        if (zlib_result != Z_OK && zlib_result != Z_STREAM_END)
+            break;
+        
+        if (!parser.parse(buffer, INFLATE_CHUNK_SIZE - zstream.avail_out))
+            break;
+    }
+    while (zlib_result != Z_STREAM_END);
     
     inflateEnd(&zstream);
-    IOFree(buffer, bufferSize);
+    releaseZlibArena((BrcmZlibArena*)zstream.opaque);
+    IOFree(buffer, INFLATE_CHUNK_SIZE);
     
+    return zlib_result == Z_STREAM_END;
+}
+
+/**********************************************
+ * LZ4 Decompression
+ **********************************************/
+#define LZ4_MIN_MATCH 4
+
+/*
+ * Read an LZ4 length continuation (bytes of 255 are summed up until a smaller one)
+ */
+static inline bool lz4_length(const UInt8* &src, const UInt8* srcEnd, UInt32 &length)
+{
+    UInt8 byte;
+    
+    do
+    {
+        if (src >= srcEnd)
+            return false;
+        byte = *src++;
+        length += byte;
+    }
+    while (byte == 255);
+    
+    return true;
+}
+
+/*
+ * Decode a single LZ4 block, which must fill the destination exactly
+ */
+static bool lz4_decode(const UInt8* src, UInt32 srcLength, UInt8* dst, UInt32 dstLength)
+{
+    const UInt8* srcEnd = src + srcLength;
+    UInt8* out = dst;
+    UInt8* outEnd = dst + dstLength;
+    
+    while (src < srcEnd)
+    {
+        UInt8 token = *src++;
+        
+        // Literals
+        UInt32 length = token >> 4;
+        if (length == 15 && !lz4_length(src, srcEnd, length))
+            return false;
+        
+        if (length > (UInt32)(srcEnd - src) || length > (UInt32)(outEnd - out))
+            return false;
+        
+        memcpy(out, src, length);
+        src += length;
+        out += length;
+        
+        // Last sequence has no match
+        if (src == srcEnd)
+            break;
+        
+        // Match
+        if (srcEnd - src < 2)
+            return false;
+        
+        UInt32 offset = src[0] | src[1] << 8;
+        src += 2;
+        
+        if (offset == 0 || offset > (UInt32)(out - dst))
+            return false;
+        
+        length = token & 0x0F;
+        if (length == 15 && !lz4_length(src, srcEnd, length))
+            return false;
+        length += LZ4_MIN_MATCH;
+        
+        if (length > (UInt32)(outEnd - out))
+            return false;
+        
+        // Matches may overlap their own output
+        const UInt8* match = out - offset;
+        if (offset >= length)
+        {
+            memcpy(out, match, length);
+            out += length;
+        }
+        else
+            while (length--)
+                *out++ = *match++;
+    }
+    
+    return out == outEnd;
+}
+
+/*
+ * Decompress LZ4 firmware into a buffer of the exact uncompressed size and hand it to the parser
+ */
+bool BrcmFirmwareStore::decompressFirmwareLZ4(const void* data, UInt32 length, UInt32 uncompressedSize, FirmwareParser &parser)
+{
+    OSData* buffer = OSData::withCapacity(uncompressedSize);
+    if (!buffer)
+        return false;
+    
+    bool result = buffer->appendBytes(NULL, uncompressedSize) &&
+                  lz4_decode((const UInt8*)data, length, (UInt8*)buffer->getBytesNoCopy(), uncompressedSize) &&
+                  parser.parse(buffer);
+    
+    buffer->release();
     return result;
 }
 
 /**********************************************
- * IntelHex firmware parsing
+ * Firmware container
  **********************************************/
-#define HEX_LINE_PREFIX ':'
-#define HEX_HEADER_SIZE 4
 
-#define REC_TYPE_DATA 0 // Data
-#define REC_TYPE_EOF 1  // End of File
-#define REC_TYPE_ESA 2  // Extended Segment Address
-#define REC_TYPE_SSA 3  // Start Segment Address
-#define REC_TYPE_ELA 4  // Extended Linear Address
-#define REC_TYPE_SLA 5  // Start Linear Address
+/*
+ * Check if the firmware starts with a container header
+ */
+static inline const BrcmFirmwareContainerHeader* getFirmwareContainer(OSData* firmware)
+{
+    if (firmware->getLength() < sizeof(BrcmFirmwareContainerHeader))
+        return NULL;
+
+    const BrcmFirmwareContainerHeader* header = (const BrcmFirmwareContainerHeader*)firmware->getBytesNoCopy();
+    return header->magic == kBrcmFirmwareContainerMagic ? header : NULL;
+}
 
 /*
- * Validate if the current character is a valid hexadecimal character
+ * Validate container version, payload size and digest
  */
-static inline bool validHexChar(UInt8 hex)
+static bool validFirmwareContainer(const BrcmFirmwareContainerHeader* header, UInt32 length)
 {
-    return (hex >= 'a' && hex <= 'f') || (hex >= 'A' && hex <= 'F') || (hex >= '0' && hex <= '9');
+    if (header->version != kBrcmFirmwareContainerVersion || header->headerSize < sizeof(BrcmFirmwareContainerHeader))
+    {
+        DebugLog("validFirmwareContainer - Unsupported container version %d.\n", header->version);
+        return false;
+    }
+
+    if ((UInt64)header->headerSize + header->compressedSize != length)
+    {
+        DebugLog("validFirmwareContainer - Invalid container size (%d bytes, payload %d bytes).\n", length, header->compressedSize);
+        return false;
+    }
+
+    SHA1_CTX ctx;
+    uint8_t hash[SHA1_RESULTLEN];
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, (const UInt8*)header + header->headerSize, header->compressedSize);
+    SHA1Final(hash, &ctx);
+
+    if (memcmp(hash, header->digest, sizeof(header->digest)) != 0)
+    {
+        DebugLog("validFirmwareContainer - Digest mismatch.\n");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Feed the container payload to the parser according to its codec
+ */
+bool BrcmFirmwareStore::decodeFirmware(const BrcmFirmwareContainerHeader* container, FirmwareParser &parser)
+{
+    const UInt8* data = (const UInt8*)container + container->headerSize;
+    
+    switch (container->codec)
+    {
+        case kBrcmFirmwareCodecNone:
+            return parser.parse(data, container->compressedSize);
+        case kBrcmFirmwareCodecZlib:
+            return decompressFirmware(data, container->compressedSize, parser);
+        case kBrcmFirmwareCodecLZ4:
+            return decompressFirmwareLZ4(data, container->compressedSize, container->uncompressedSize, parser);
+        case kBrcmFirmwareCodecDelta:
+            return decompressFirmwareDelta(data, container->compressedSize, parser);
+        default:
+            DebugLog("decodeFirmware - Unsupported codec %d.\n", container->codec);
+            return false;
+    }
+}
+
+/**********************************************
+ * Delta firmware
+ **********************************************/
+
+/*
+ * Read an unsigned LEB128 varint
+ */
+static inline bool delta_varint(const UInt8* &src, const UInt8* srcEnd, UInt32 &value)
+{
+    value = 0;
+    
+    for (UInt32 shift = 0; shift < 32; shift += 7)
+    {
+        if (src >= srcEnd)
+            return false;
+        
+        UInt8 byte = *src++;
+        value |= (UInt32)(byte & 0x7F) << shift;
+        
+        if (!(byte & 0x80))
+            return true;
+    }
+    
+    return false;
+}
+
+/*
+ * Decode a chip family base firmware into its raw data
+ */
+OSData* BrcmFirmwareStore::decodeFirmwareBase(OSData* firmware)
+{
+    // Bases are regular containers, deltas of deltas are not supported
+    const BrcmFirmwareContainerHeader* container = getFirmwareContainer(firmware);
+    OSData* result = NULL;
+    
+    if (container && container->codec != kBrcmFirmwareCodecDelta && validFirmwareContainer(container, firmware->getLength()))
+    {
+        FirmwareParser parser(container->uncompressedSize, true);
+        bool patchStream;
+        
+        if (decodeFirmware(container, parser) && parser.getLength() == container->uncompressedSize)
+            result = parser.finish(patchStream);
+    }
+    
+    return result;
+}
+
+/*
+ * The decoded base never references the resource, so it is always decoded in place
+ */
+bool BrcmFirmwareStore::decodeBaseResource(OSData* resource, OSData* &result)
+{
+    result = decodeFirmwareBase(resource);
+    return true;
+}
+
+/*
+ * Load and decode the chip family base firmware a delta refers to
+ */
+OSData* BrcmFirmwareStore::loadFirmwareBase(const char* baseName)
+{
+#ifdef FIRMWAREDATA
+    char filename[PATH_MAX];
+    snprintf(filename, PATH_MAX, "%s.%s", baseName, kBrcmFirmwareCompressed);
+    OSData* configuredData = lookupFirmware(filename);
+#else
+    bool decoded, missing;
+    OSData* configuredData = loadFirmwareFile(baseName, kBrcmFirmwareCompressed, &BrcmFirmwareStore::decodeBaseResource, decoded, missing);
+    
+    if (decoded)
+    {
+        if (!configuredData)
+            AlwaysLog("Base firmware \"%s\" is not valid.\n", baseName);
+        return configuredData;
+    }
+#endif
+    
+    if (!configuredData)
+    {
+        OSDictionary* firmwares = OSDynamicCast(OSDictionary, this->getProperty("Firmwares"));
+        
+        if (firmwares && (configuredData = OSDynamicCast(OSData, firmwares->getObject(baseName))))
+            configuredData->retain();
+    }
+    
+    if (!configuredData)
+    {
+        AlwaysLog("No base firmware available for \"%s\".\n", baseName);
+        return NULL;
+    }
+    
+    OSData* result = decodeFirmwareBase(configuredData);
+    
+    if (!result)
+        AlwaysLog("Base firmware \"%s\" is not valid.\n", baseName);
+    
+    configuredData->release();
+    return result;
+}
+
+/*
+ * Reconstruct the firmware from its base and the delta operations, feeding it to the parser as it is rebuilt
+ */
+bool BrcmFirmwareStore::decompressFirmwareDelta(const void* data, UInt32 length, FirmwareParser &parser)
+{
+    const BrcmFirmwareDeltaHeader* delta = (const BrcmFirmwareDeltaHeader*)data;
+    
+    if (length < sizeof(BrcmFirmwareDeltaHeader))
+        return false;
+    
+    char baseName[sizeof(delta->baseName) + 1];
+    memcpy(baseName, delta->baseName, sizeof(delta->baseName));
+    baseName[sizeof(delta->baseName)] = '\0';
+    
+    OSData* base = loadFirmwareBase(baseName);
+    if (!base)
+        return false;
+    
+    const UInt8* baseData = (const UInt8*)base->getBytesNoCopy();
+    UInt32 baseLength = base->getLength();
+    
+    // The base must be exactly the firmware the delta was created against
+    SHA1_CTX ctx;
+    uint8_t hash[SHA1_RESULTLEN];
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, baseData, baseLength);
+    SHA1Final(hash, &ctx);
+    
+    if (memcmp(hash, delta->baseDigest, sizeof(delta->baseDigest)) != 0)
+    {
+        AlwaysLog("Base firmware \"%s\" does not match delta.\n", baseName);
+        base->release();
+        return false;
+    }
+    
+    FirmwareParser operationsParser(delta->operationsSize, true);
+    OSData* operations = NULL;
+    bool patchStream;
+    bool result = decompressFirmware(delta + 1, length - sizeof(BrcmFirmwareDeltaHeader), operationsParser) &&
+                  operationsParser.getLength() == delta->operationsSize &&
+                  (operations = operationsParser.finish(patchStream));
+    
+    const UInt8* src = operations ? (const UInt8*)operations->getBytesNoCopy() : NULL;
+    const UInt8* srcEnd = operations ? src + operations->getLength() : NULL;
+    
+    while (result && src < srcEnd)
+    {
+        UInt32 insert, offset, copy;
+        
+        // Inserted bytes
+        if (!delta_varint(src, srcEnd, insert) || insert > (UInt32)(srcEnd - src) || !parser.parse(src, insert))
+        {
+            result = false;
+            break;
+        }
+        src += insert;
+        
+        // Bytes copied from the base
+        if (!delta_varint(src, srcEnd, offset) || !delta_varint(src, srcEnd, copy) ||
+            offset > baseLength || copy > baseLength - offset || !parser.parse(baseData + offset, copy))
+            result = false;
+    }
+    
+    OSSafeReleaseNULL(operations);
+    base->release();
+    return result;
 }
 
+/**********************************************
+ * LAUNCH_RAM record coalescing
+ **********************************************/
+#define LAUNCH_RAM_HEADER_SIZE  3   // Opcode (2 bytes), length (1 byte)
+#define LAUNCH_RAM_ADDRESS_SIZE 4
+#define LAUNCH_RAM_MAX_LENGTH   255 // Maximum HCI command parameter length
+
 /*
- * Convert char '0-9,A-F' to hexadecimal values
+ * Count the instructions and the total number of bytes sent for them
  */
-static inline void hex_nibble(UInt8 hex, UInt8 &output)
+static void firmwareStatistics(OSData* instructions, UInt32 &records, UInt32 &bytes)
 {
-    output <<= 4;
-    
-    if (hex >= 'a')
-        output |= (0x0A + (hex - 'a')) & 0x0F;
-    if (hex >= 'A')
-        output |= (0x0A + (hex - 'A')) & 0x0F;
-    else
-        output |= (hex - '0') & 0x0F;
+    const BrcmPatchStreamHeader* header = (const BrcmPatchStreamHeader*)instructions->getBytesNoCopy();
+
+    records = header->recordCount;
+    bytes = header->dataSize;
 }
 
 /*
- * Two's complement checksum
+ * Merge address contiguous LAUNCH_RAM instructions into commands up to the maximum HCI parameter length.
+ * The instructions carry absolute addresses with any ELA/ESA base already applied, so contiguous
+ * addresses are all a merge needs. Anything which is not a LAUNCH_RAM instruction is passed through unchanged.
  */
-static char check_sum(const UInt8* data, UInt16 len)
+OSData* BrcmFirmwareStore::coalesceFirmware(OSData* instructions)
 {
-    UInt32 crc = 0;
-    
-    for (int i = 0; i < len; i++)
-        crc += *(data + i);
-    
-    return (~crc + 1) & 0xFF;
-}
+    BrcmPatchStreamIterator iterator;
+    iterator.reset(instructions);
 
-OSArray* BrcmFirmwareStore::parseFirmware(OSData* firmwareData)
-{
-    // Vendor Specific: Launch RAM
-    UInt8 HCI_VSC_LAUNCH_RAM[] = { 0x4c, 0xfc };
-    
-    OSArray* instructions = OSArray::withCapacity(1);
-    if (!instructions)
-        return NULL;
+    PatchStreamBuilder result(instructions->getLength(), iterator.getCount());
 
-    UInt8* data = (UInt8*)firmwareData->getBytesNoCopy();
-    UInt32 address = 0;
-    UInt8 binary[0x110];
-    
-    if (*data != HEX_LINE_PREFIX)
-    {
-        DebugLog("parseFirmware - Invalid firmware data.\n");
-        goto exit_error;
-    }
-    
-    while (*data == HEX_LINE_PREFIX)
+    UInt8 command[LAUNCH_RAM_HEADER_SIZE + LAUNCH_RAM_MAX_LENGTH];
+    UInt32 commandLength = 0;
+    UInt32 nextAddress = 0;
+
+    const UInt8* bytes;
+    UInt16 length;
+    bool more = true;
+
+    while (more)
     {
-        bzero(binary, sizeof(binary));
-        data++;
-        
-        int offset = 0;
-        
-        // Read all hex characters for this line
-        while (validHexChar(*data))
+        more = iterator.getNextInstruction(bytes, length);
+
+        bool launchRam = more && length >= LAUNCH_RAM_HEADER_SIZE + LAUNCH_RAM_ADDRESS_SIZE &&
+                         bytes[0] == 0x4c && bytes[1] == 0xfc && length - LAUNCH_RAM_HEADER_SIZE == bytes[2];
+        UInt32 address = launchRam ? OSReadLittleInt32(bytes, LAUNCH_RAM_HEADER_SIZE) : 0;
+        UInt32 payload = launchRam ? length - LAUNCH_RAM_HEADER_SIZE - LAUNCH_RAM_ADDRESS_SIZE : 0;
+
+        // Extend the pending command if this instruction directly follows it
+        if (launchRam && commandLength && address == nextAddress && commandLength + payload <= sizeof(command))
         {
-            hex_nibble(*data++, binary[offset]);
-            hex_nibble(*data++, binary[offset++]);
+            memcpy(command + commandLength, bytes + LAUNCH_RAM_HEADER_SIZE + LAUNCH_RAM_ADDRESS_SIZE, payload);
+            commandLength += payload;
+            nextAddress += payload;
+            continue;
         }
-        
-        // Parse line data
-        UInt8 length = binary[0];
-        UInt16 addr = binary[1] << 8 | binary[2];
-        UInt8 record_type = binary[3];
-        UInt8 checksum = binary[HEX_HEADER_SIZE + length];
-        
-        UInt8 calc_checksum = check_sum(binary, HEX_HEADER_SIZE  + length);
-        
-        if (checksum != calc_checksum)
+
+        // Flush pending command
+        if (commandLength)
         {
-            DebugLog("parseFirmware - Invalid firmware, checksum mismatch.\n");
-            goto exit_error;
+            command[2] = commandLength - LAUNCH_RAM_HEADER_SIZE;
+
+            if (!result.appendInstruction(command, commandLength))
+                return NULL;
+
+            commandLength = 0;
         }
-        
-        // ParseFirmware class only supports I32HEX format
-        switch (record_type)
+
+        if (launchRam)
         {
-            // Data
-            case REC_TYPE_DATA:
-            {
-                address = (address & 0xFFFF0000) | addr;
-                
-                // Reserved 4 bytes for the address
-                length += 4;
-                
-                // Allocate instruction (Opcode - 2 bytes, length - 1 byte)
-                OSData* instruction = OSData::withCapacity(3 + length);
-                if (!instruction)
-                    goto exit_error;
-                
-                instruction->appendBytes(HCI_VSC_LAUNCH_RAM, sizeof(HCI_VSC_LAUNCH_RAM));
-                instruction->appendBytes(&length, sizeof(length));
-                instruction->appendBytes(&address, sizeof(address));
-                instruction->appendBytes(&binary[4], length - 4);
-                
-                instructions->setObject(instruction);
-                instruction->release();
-                break;
-            }
-            // End of File
-            case REC_TYPE_EOF:
-                return instructions;
-            // Extended Segment Address
-            case REC_TYPE_ESA:
-                // Segment address multiplied by 16
-                address = binary[4] << 8 | binary[5];
-                address <<= 4;
-                break;
-                // Start Segment Address
-            case REC_TYPE_SSA:
-                // Set CS:IP register for 80x86
-                DebugLog("parseFirmware - Invalid firmware, unsupported start segment address instruction.\n");
-                goto exit_error;
-                // Extended Linear Address
-            case REC_TYPE_ELA:
-                // Set new higher 16 bits of the current address
-                address = binary[4] << 24 | binary[5] << 16;
-                break;
-                // Start Linear Address
-            case REC_TYPE_SLA:
-                // Set EIP of 80386 and higher
-                DebugLog("parseFirmware - Invalid firmware, unsupported start linear address instruction.\n");
-                goto exit_error;
-            default:
-                DebugLog("parseFirmware - Invalid firmware, unknown record type encountered: 0x%02x.\n", record_type);
-                goto exit_error;
+            memcpy(command, bytes, length);
+            commandLength = length;
+            nextAddress = address + payload;
         }
-        
-        // Skip over any trailing newlines / whitespace
-        while (!validHexChar(*data) && !(*data == HEX_LINE_PREFIX))
-            data++;
+        else if (more && !result.appendInstruction(bytes, length))
+            return NULL;
     }
-    
-    DebugLog("parseFirmware - Invalid firmware.\n");
-    
-exit_error:
-    OSSafeReleaseNULL(instructions);
-    return NULL;
+
+    return result.finish();
 }
 
 OSDefineMetaClassAndStructors(BrcmFirmwareStore, IOService)
@@ -306,6 +1121,23 @@ bool BrcmFirmwareStore::start(IOService *provider)
     mFirmwares = OSDictionary::withCapacity(1);
     if (!mFirmwares)
         return false;
+
+    mCoalescedFirmwares = OSDictionary::withCapacity(1);
+    if (!mCoalescedFirmwares)
+        return false;
+
+    mLoadingFirmwares = OSDictionary::withCapacity(1);
+    if (!mLoadingFirmwares)
+        return false;
+
+    mMissingFirmwares = OSDictionary::withCapacity(1);
+    if (!mMissingFirmwares)
+        return false;
+
+    mMissingFirmwareTTL = kBrcmMissingFirmwareTTLDefault;
+    if (OSNumber* missingFirmwareTTL = OSDynamicCast(OSNumber, getProperty(kBrcmMissingFirmwareTTL)))
+        mMissingFirmwareTTL = missingFirmwareTTL->unsigned32BitValue();
+    mMissingFirmwareTTL *= 1000000000ULL;
     
     mCompletionLock = IOLockAlloc();
     if (!mCompletionLock)
@@ -315,6 +1147,16 @@ bool BrcmFirmwareStore::start(IOService *provider)
     if (!mDataLock)
         return false;
 
+    // zlib decompression draws from these instead of allocating its workspace for every firmware
+    for (int i = 0; i < kBrcmZlibArenaCount; i++)
+    {
+        for (int j = 0; j < kBrcmZlibArenaClasses; j++)
+        {
+            if (!(mZlibArenas[i].slots[j] = (UInt8*)IOMalloc(kZlibArenaClassSizes[j])))
+                return false;
+        }
+    }
+
     registerService();
 
     return true;
@@ -325,6 +1167,11 @@ void BrcmFirmwareStore::stop(IOService *provider)
     DebugLog("Firmware store stop\n");
     
     OSSafeReleaseNULL(mFirmwares);
+    OSSafeReleaseNULL(mCoalescedFirmwares);
+    OSSafeReleaseNULL(mLoadingFirmwares);
+    OSSafeReleaseNULL(mMissingFirmwares);
+    OSSafeReleaseNULL(mMissingFirmwaresSource);
+    OSSafeReleaseNULL(mManifest);
     
     if (mCompletionLock)
     {
@@ -338,82 +1185,229 @@ void BrcmFirmwareStore::stop(IOService *provider)
         mDataLock = NULL;
     }
     
+    for (int i = 0; i < kBrcmZlibArenaCount; i++)
+    {
+        for (int j = 0; j < kBrcmZlibArenaClasses; j++)
+        {
+            if (mZlibArenas[i].slots[j])
+            {
+                IOFree(mZlibArenas[i].slots[j], kZlibArenaClassSizes[j]);
+                mZlibArenas[i].slots[j] = NULL;
+            }
+        }
+    }
+    
     super::stop(provider);
 }
 
+/*
+ * Check a loaded resource against its manifest entry
+ */
+static bool validManifestEntry(OSDictionary* entry, OSData* firmware)
+{
+    OSNumber* size = OSDynamicCast(OSNumber, entry->getObject("Size"));
+    OSData* digest = OSDynamicCast(OSData, entry->getObject("SHA1"));
+    
+    if (size && size->unsigned32BitValue() != firmware->getLength())
+        return false;
+    
+    if (digest)
+    {
+        SHA1_CTX ctx;
+        uint8_t hash[SHA1_RESULTLEN];
+        SHA1Init(&ctx);
+        SHA1Update(&ctx, firmware->getBytesNoCopy(), firmware->getLength());
+        SHA1Final(hash, &ctx);
+        
+        if (digest->getLength() != SHA1_RESULTLEN || memcmp(hash, digest->getBytesNoCopy(), SHA1_RESULTLEN) != 0)
+            return false;
+    }
+    
+    return true;
+}
+
 void BrcmFirmwareStore::requestResourceCallback(OSKextRequestTag requestTag, OSReturn result, const void * resourceData, uint32_t resourceDataLength, void* context1)
 {
     ResourceCallbackContext *context = (ResourceCallbackContext*)context1;
     
-    IOLockLock(context->me->mCompletionLock);
-
     if (kOSReturnSuccess == result)
     {
         DebugLog("OSKextRequestResource Callback: %d bytes of data.\n", resourceDataLength);
         
-        context->firmware = OSData::withBytes(resourceData, resourceDataLength);
+        // The resource data is only valid during the callback, decode it in place instead of copying it when possible
+        OSData* resource = OSData::withBytesNoCopy((void*)resourceData, resourceDataLength);
+        
+        if (resource && context->manifestEntry && !validManifestEntry(context->manifestEntry, resource))
+            AlwaysLog("Firmware \"%s\" does not match manifest.\n", context->path);
+        else if (resource && context->decoder && (context->me->*context->decoder)(resource, context->firmware))
+            context->decoded = true;
+        else
+            context->firmware = OSData::withBytes(resourceData, resourceDataLength);
+        
+        OSSafeReleaseNULL(resource);
     }
     else
         DebugLog("OSKextRequestResource Callback: %08x.\n", result);
     
+    IOLockLock(context->me->mCompletionLock);
+    context->result = result;
+    context->completed = true;
     IOLockUnlock(context->me->mCompletionLock);
     
-    // wake waiting task in performUpgrade (in IOLockSleep)...
-    IOLockWakeup(context->me->mCompletionLock, context->me, true);
+    // wake the task waiting for this request in requestResource (in IOLockSleep)...
+    IOLockWakeup(context->me->mCompletionLock, context, true);
 }
 
-OSData* BrcmFirmwareStore::loadFirmwareFile(const char* filename, const char* suffix)
+/*
+ * missing is only set if the resource definitely does not exist, not when the request itself failed
+ */
+OSData* BrcmFirmwareStore::requestResource(const char* path, OSDictionary* manifestEntry, ResourceDecoder decoder, bool &decoded, bool &missing)
 {
     IOLockLock(mCompletionLock);
 
-    ResourceCallbackContext context = { .me = this, .firmware = NULL };
+    ResourceCallbackContext context = { .me = this, .firmware = NULL, .path = path, .manifestEntry = manifestEntry, .decoder = decoder, .decoded = false, .completed = false, .result = kOSReturnError };
 
-    char path[PATH_MAX];
-    snprintf(path, PATH_MAX, "%s.%s", filename, suffix);
-    
     OSReturn ret = OSKextRequestResource(OSKextGetCurrentIdentifier(),
                           path,
                           requestResourceCallback,
                           &context,
                           NULL);
-    (void) ret;
     DebugLog("OSKextRequestResource: %08x\n", ret);
     
-    // wait for completion of the async read
-    IOLockSleep(mCompletionLock, this, 0);
+    // wait for completion of the async read, several requests may be pending concurrently
+    while (ret == kOSReturnSuccess && !context.completed)
+        IOLockSleep(mCompletionLock, &context, THREAD_UNINT);
     
     IOLockUnlock(mCompletionLock);
     
-    if (context.firmware)
+    decoded = context.decoded;
+    missing = ret == kOSReturnSuccess && context.result == kOSKextReturnNotFound;
+    return context.firmware;
+}
+
+/*
+ * The manifest lists the firmware resources (name, size and SHA1), so names are resolved in memory
+ * and only the one listed is requested. It is requested once per store lifetime, without a manifest
+ * every name is requested as before.
+ */
+OSDictionary* BrcmFirmwareStore::getManifest()
+{
+    IOLockLock(mDataLock);
+    
+    while (mManifestLoading)
+        IOLockSleep(mDataLock, &mManifest, THREAD_UNINT);
+    
+    if (!mManifestLoaded)
     {
-        AlwaysLog("Loaded firmware \"%s\" from resources.\n", path);
-        return context.firmware;
+        mManifestLoading = true;
+        IOLockUnlock(mDataLock);
+        
+        OSDictionary* manifest = NULL;
+        bool decoded, missing;
+        OSData* data = requestResource(kBrcmFirmwareManifest, NULL, NULL, decoded, missing);
+        
+        if (data)
+        {
+            OSObject* object = OSUnserializeXML((const char*)data->getBytesNoCopy(), data->getLength());
+            
+            if (!(manifest = OSDynamicCast(OSDictionary, object)))
+                OSSafeReleaseNULL(object);
+            data->release();
+        }
+        
+        if (manifest)
+            AlwaysLog("Loaded firmware manifest with %d entries.\n", manifest->getCount());
+        else
+            DebugLog("No firmware manifest available.\n");
+        
+        IOLockLock(mDataLock);
+        mManifest = manifest;
+        mManifestLoaded = true;
+        mManifestLoading = false;
+        IOLockWakeup(mDataLock, &mManifest, false);
+    }
+    
+    OSDictionary* result = mManifest;
+    IOLockUnlock(mDataLock);
+    
+    return result;
+}
+
+OSData* BrcmFirmwareStore::loadFirmwareFile(const char* filename, const char* suffix, ResourceDecoder decoder, bool &decoded, bool &missing)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s.%s", filename, suffix);
+    
+    decoded = false;
+    missing = false;
+    
+    OSDictionary* manifest = getManifest();
+    OSDictionary* entry = NULL;
+    
+    if (manifest && !(entry = OSDynamicCast(OSDictionary, manifest->getObject(path))))
+    {
+        DebugLog("Firmware \"%s\" is not listed in manifest.\n", path);
+        missing = true;
+        return NULL;
     }
+    
+    OSData* firmware = requestResource(path, entry, decoder, decoded, missing);
+    
+    if (firmware || decoded)
+        AlwaysLog("Loaded firmware \"%s\" from resources.\n", path);
 
-    return NULL;
+    return firmware;
 }
 
-OSData* BrcmFirmwareStore::loadFirmwareFiles(UInt16 vendorId, UInt16 productId, OSString* firmwareKey)
+/*
+ * Firmwares are parsed while the resource is borrowed (parsed is set), unless they have to be copied.
+ * missing is set if none of the names exists. With a manifest only the first name it lists is requested.
+ */
+OSData* BrcmFirmwareStore::loadFirmwareFiles(UInt16 vendorId, UInt16 productId, OSString* firmwareKey, bool &parsed, bool &missing)
 {
     char filename[PATH_MAX];
     snprintf(filename, PATH_MAX, "%04x_%04x", vendorId, productId);
 
-    OSData* result = loadFirmwareFile(filename, kBrcmFirmwareCompressed);
+    const char* names[] = { filename, filename, firmwareKey->getCStringNoCopy(), firmwareKey->getCStringNoCopy() };
+    const char* suffixes[] = { kBrcmFirmwareCompressed, kBrmcmFirwareUncompressed, kBrcmFirmwareCompressed, kBrmcmFirwareUncompressed };
+    OSDictionary* manifest = getManifest();
+    OSData* result = NULL;
+    bool notFound;
 
-    if (!result)
-        result = loadFirmwareFile(filename, kBrmcmFirwareUncompressed);
+    parsed = false;
+    missing = true;
 
-    if (!result)
-        result = loadFirmwareFile(firmwareKey->getCStringNoCopy(), kBrcmFirmwareCompressed);
-    
-    if (!result)
-        result = loadFirmwareFile(firmwareKey->getCStringNoCopy(), kBrmcmFirwareUncompressed);
+    if (manifest)
+    {
+        char path[PATH_MAX];
+
+        for (int i = 0; i < 4; i++)
+        {
+            snprintf(path, PATH_MAX, "%s.%s", names[i], suffixes[i]);
+
+            if (manifest->getObject(path))
+                return loadFirmwareFile(names[i], suffixes[i], &BrcmFirmwareStore::parseResource, parsed, missing);
+        }
+
+        DebugLog("No firmware for key \"%s\" is listed in manifest.\n", firmwareKey->getCStringNoCopy());
+        return NULL;
+    }
+
+    for (int i = 0; i < 4 && !result && !parsed; i++)
+    {
+        result = loadFirmwareFile(names[i], suffixes[i], &BrcmFirmwareStore::parseResource, parsed, notFound);
+        missing = missing && notFound;
+    }
 
     return result;
 }
 
-OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareKey)
+/*
+ * missing is set if no firmware exists under any name, but not if loading or decoding it failed
+ */
+OSData* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareKey, bool &missing)
 {
+    missing = false;
 #ifdef FIRMWAREDATA
     char filename[PATH_MAX];
     // Try to load from internal binary data
@@ -429,10 +1423,16 @@ OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSSt
         if (configuredData)
             AlwaysLog("Loaded compressed embedded firmware for key \"%s\".\n", firmwareKey->getCStringNoCopy());
     }
+    missing = !configuredData;
 #else
     // Try to load firmware from disk
     DebugLog("loadFirmware from disk data %s\n", firmwareKey->getCStringNoCopy());
-    OSData* configuredData = loadFirmwareFiles(vendorId, productId, firmwareKey);
+    bool parsed;
+    OSData* configuredData = loadFirmwareFiles(vendorId, productId, firmwareKey, parsed, missing);
+    
+    // Already parsed out of the resource data
+    if (parsed)
+        return configuredData;
 #endif
 
     // Next try to load firmware from configuration
@@ -451,6 +1451,7 @@ OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSSt
         if (configuredData)
         {
             configuredData->retain();
+            missing = false;
             AlwaysLog("Retrieved firmware \"%s\" from internal configuration.\n", firmwareKey->getCStringNoCopy());
         }
     }
@@ -461,37 +1462,75 @@ OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSSt
         return NULL;
     }
     
-    OSData* firmwareData = decompressFirmware(configuredData);
+    OSData* instructions = parseFirmware(configuredData);
+    configuredData->release();
     
-    if (!firmwareData)
+    return instructions;
+}
+
+/*
+ * Decode (decompress, validate and parse) firmware into instructions
+ */
+OSData* BrcmFirmwareStore::parseFirmware(OSData* firmware)
+{
+    const BrcmFirmwareContainerHeader* container = getFirmwareContainer(firmware);
+    bool compressed = container ? container->codec != kBrcmFirmwareCodecNone : isCompressed(firmware);
+    
+    if (container && !validFirmwareContainer(container, firmware->getLength()))
+    {
+        AlwaysLog("Firmware container is corrupt.\n");
+        return NULL;
+    }
+    
+    // Compressed firmware is parsed while it is being inflated
+    UInt32 sizeHint = firmware->getLength();
+    if (container)
+        sizeHint = container->uncompressedSize;
+    else if (compressed)
+        sizeHint *= 4;
+    
+    FirmwareParser parser(sizeHint);
+    bool decoded = true;
+    
+    if (container)
+        decoded = decodeFirmware(container, parser) && parser.getLength() == container->uncompressedSize;
+    else if (compressed)
+        decoded = decompressFirmware(firmware->getBytesNoCopy(), firmware->getLength(), parser);
+    else
+        parser.parse(firmware);
+    
+    if (!decoded)
     {
-        configuredData->release();
         AlwaysLog("Failed to decompress firmware.\n");
         return NULL;
     }
     
-    if (configuredData->getLength() < firmwareData->getLength())
-        AlwaysLog("Decompressed firmware (%d bytes --> %d bytes).\n", configuredData->getLength(), firmwareData->getLength());
+    if (compressed)
+        AlwaysLog("Decompressed firmware (%d bytes --> %d bytes).\n", firmware->getLength(), parser.getLength());
     else
         AlwaysLog("Non-compressed firmware.\n");
 
-    configuredData->release();
+    bool patchStream;
+    OSData* firmwareData = parser.finish(patchStream);
 
-#ifdef DEBUG
-    SHA1_CTX ctx;
-    uint8_t hash[SHA1_RESULTLEN];
-    SHA1Init(&ctx);
-    SHA1Update(&ctx, firmwareData->getBytesNoCopy(), firmwareData->getLength());
-    SHA1Final(hash, &ctx);
-    DebugLog("Firmware SHA1: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\n",
-             hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7], hash[8], hash[9],
-             hash[10], hash[11], hash[12], hash[13], hash[14], hash[15], hash[16], hash[17], hash[18], hash[19]);
-#endif
+    // Pre-compiled patch streams need no IntelHex decoding
+    if (patchStream)
+    {
+        OSData* instructions = firmwareData && isPatchStream(firmwareData) ? parsePatchStream(firmwareData) : NULL;
+        OSSafeReleaseNULL(firmwareData);
+
+        if (!instructions)
+        {
+            AlwaysLog("Firmware is not a valid patch stream.\n");
+            return NULL;
+        }
+
+        AlwaysLog("Firmware is valid patch stream.\n");
 
-    OSArray* instructions = parseFirmware(firmwareData);
-    firmwareData->release();
+        return instructions;
+    }
     
-    if (!instructions)
+    if (!firmwareData)
     {
         AlwaysLog("Firmware is not valid IntelHex firmware.\n");
         return NULL;
@@ -499,10 +1538,56 @@ OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSSt
     
     AlwaysLog("Firmware is valid IntelHex firmware.\n");
     
-    return instructions;
+    return firmwareData;
+}
+
+/*
+ * Parse firmware straight out of a borrowed resource buffer.
+ * Delta firmwares request their base resource and uncompressed patch streams are kept as is, those are copied instead.
+ */
+bool BrcmFirmwareStore::parseResource(OSData* resource, OSData* &result)
+{
+    const BrcmFirmwareContainerHeader* container = getFirmwareContainer(resource);
+    
+    if (container ? container->codec == kBrcmFirmwareCodecDelta : !isCompressed(resource) && isPatchStream(resource))
+        return false;
+    
+    result = parseFirmware(resource);
+    return true;
+}
+
+/*
+ * Whether none of names (vid_pid and firmware key) was found within mMissingFirmwareTTL (called with mDataLock held).
+ * Failures are forgotten when the configured Firmwares (e.g. of an injector) change.
+ */
+bool BrcmFirmwareStore::isFirmwareMissing(const char* names)
+{
+    OSObject* firmwares = this->getProperty("Firmwares");
+    
+    if (firmwares != mMissingFirmwaresSource)
+    {
+        mMissingFirmwares->flushCollection();
+        OSSafeReleaseNULL(mMissingFirmwaresSource);
+        if ((mMissingFirmwaresSource = firmwares))
+            mMissingFirmwaresSource->retain();
+    }
+    
+    OSNumber* failed = OSDynamicCast(OSNumber, mMissingFirmwares->getObject(names));
+    if (!failed)
+        return false;
+    
+    UInt64 now, nano_secs;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - failed->unsigned64BitValue(), &nano_secs);
+    
+    if (nano_secs < mMissingFirmwareTTL)
+        return true;
+    
+    mMissingFirmwares->removeObject(names);
+    return false;
 }
 
-OSArray* BrcmFirmwareStore::getFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareKey)
+OSData* BrcmFirmwareStore::getFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareKey, bool coalesce)
 {
     DebugLog("getFirmware\n");
     
@@ -512,25 +1597,109 @@ OSArray* BrcmFirmwareStore::getFirmware(UInt16 vendorId, UInt16 productId, OSStr
         return NULL;
     }
     
+    // the names loadFirmware tries, the same key may be missing for one device but not for another
+    char names[PATH_MAX];
+    snprintf(names, PATH_MAX, "%04x_%04x %s", vendorId, productId, firmwareKey->getCStringNoCopy());
+    
     IOLockLock(mDataLock);
-    OSArray* instructions = OSDynamicCast(OSArray, mFirmwares->getObject(firmwareKey));
+    
+    // Another thread is loading firmwareKey, wait for its result
+    while (mLoadingFirmwares->getObject(firmwareKey))
+        IOLockSleep(mDataLock, mLoadingFirmwares, THREAD_UNINT);
+    
+    OSData* instructions = OSDynamicCast(OSData, mFirmwares->getObject(firmwareKey));
+    
+    // No firmware found for firmwareKey recently?
+    if (!instructions && isFirmwareMissing(names))
+    {
+        setProperty(kBrcmMissingFirmwareHits, ++mMissingFirmwareHits, 32);
+        IOLockUnlock(mDataLock);
+        
+        DebugLog("No firmware available for firmware key \"%s\" (cached).\n", firmwareKey->getCStringNoCopy());
+        return NULL;
+    }
     
     // Cached instructions found for firmwareKey?
     if (!instructions)
     {
-        // Load instructions for firmwareKey
-        instructions = loadFirmware(vendorId, productId, firmwareKey);
+        setProperty(kBrcmMissingFirmwareMisses, ++mMissingFirmwareMisses, 32);
+        
+        // Load instructions for firmwareKey without holding the lock, so different keys load in parallel
+        mLoadingFirmwares->setObject(firmwareKey, kOSBooleanTrue);
+        IOLockUnlock(mDataLock);
+        
+        bool missing;
+        instructions = loadFirmware(vendorId, productId, firmwareKey, missing);
+        
+        IOLockLock(mDataLock);
         
         // Add instructions to the firmwares cache
         if (instructions)
         {
+            UInt32 records, bytes;
+            firmwareStatistics(instructions, records, bytes);
+            AlwaysLog("Firmware \"%s\" contains %d records (%d bytes).\n", firmwareKey->getCStringNoCopy(), records, bytes);
+
             mFirmwares->setObject(firmwareKey, instructions);
             instructions->release();
         }
+        else if (missing && mMissingFirmwareTTL)
+        {
+            // Remember firmware that does not exist, so retries and wakes do not probe every source again.
+            // Failed requests and corrupt firmware are tried again, also by the threads waiting for this one.
+            UInt64 now;
+            clock_get_uptime(&now);
+            OSNumber* failed = OSNumber::withNumber(now, 64);
+            if (failed)
+            {
+                mMissingFirmwares->setObject(names, failed);
+                failed->release();
+            }
+        }
+        
+        mLoadingFirmwares->removeObject(firmwareKey);
+        IOLockWakeup(mDataLock, mLoadingFirmwares, false);
     }
     else
         DebugLog("Retrieved cached firmware for \"%s\".\n", firmwareKey->getCStringNoCopy());
 
+    if (instructions && coalesce)
+    {
+        // Another thread is coalescing firmwareKey, wait for its result
+        while (mLoadingFirmwares->getObject(firmwareKey))
+            IOLockSleep(mDataLock, mLoadingFirmwares, THREAD_UNINT);
+        
+        OSData* coalesced = OSDynamicCast(OSData, mCoalescedFirmwares->getObject(firmwareKey));
+
+        if (!coalesced)
+        {
+            // Coalesce without holding the lock, so other keys are not held up meanwhile
+            mLoadingFirmwares->setObject(firmwareKey, kOSBooleanTrue);
+            IOLockUnlock(mDataLock);
+            
+            coalesced = coalesceFirmware(instructions);
+            
+            IOLockLock(mDataLock);
+            
+            if (coalesced)
+            {
+                UInt32 records, bytes;
+                firmwareStatistics(coalesced, records, bytes);
+                AlwaysLog("Coalesced firmware \"%s\" into %d records (%d bytes).\n", firmwareKey->getCStringNoCopy(), records, bytes);
+
+                mCoalescedFirmwares->setObject(firmwareKey, coalesced);
+                coalesced->release();
+            }
+            
+            mLoadingFirmwares->removeObject(firmwareKey);
+            IOLockWakeup(mDataLock, mLoadingFirmwares, false);
+        }
+
+        // Fall back to the original instructions if coalescing failed
+        if (coalesced)
+            instructions = coalesced;
+    }
+
     IOLockUnlock(mDataLock);
     
     return instructions;
@@ -26,37 +26,209 @@
 
 #define kBrcmFirmwareCompressed     "zhx"
 #define kBrmcmFirwareUncompressed   "hex"
+#define kBrcmFirmwareManifest       "Manifest.plist"
 
 #define kBrcmFirmwareStoreService "BrcmFirmwareStore"
 
+// Firmwares not found under any of their names are not probed again for MissingFirmwareTTL seconds (0 disables)
+#define kBrcmMissingFirmwareTTL     "MissingFirmwareTTL"
+#define kBrcmMissingFirmwareTTLDefault 600
+#define kBrcmMissingFirmwareHits    "MissingFirmwareCacheHits"
+#define kBrcmMissingFirmwareMisses  "MissingFirmwareCacheMisses"
+
+// Preallocated zlib workspaces (inflate state and 32KB window), one per concurrent decompression
+#define kBrcmZlibArenaCount         2
+#define kBrcmZlibArenaClasses       2
+#define kBrcmZlibArenaHighWater     "ZlibArenaHighWater"
+
+/*
+ * Pre-compiled patch stream (see firmware.rb --compile)
+ *
+ * Holds the final HCI_VSC_LAUNCH_RAM commands back to back, so no IntelHex
+ * decoding is needed at load time. Layout (little endian):
+ *   BrcmPatchStreamHeader, dataSize bytes of commands, recordCount UInt32
+ *   offsets (relative to the first command) indexing each command.
+ * A patch stream may be stored zlib compressed as .zhx just like IntelHex.
+ *
+ * The same layout is used by BrcmFirmwareStore to hold parsed firmware
+ * instructions in a single OSData.
+ */
+#define kBrcmPatchStreamMagic   0x53525042 // 'BPRS'
+#define kBrcmPatchStreamVersion 1
+
+typedef struct __attribute__((packed)) BrcmPatchStreamHeader
+{
+    UInt32 magic;
+    UInt16 version;
+    UInt16 headerSize;
+    UInt32 recordCount;
+    UInt32 dataSize;
+} BrcmPatchStreamHeader;
+
+/*
+ * Firmware container (.zhx written by firmware.rb)
+ *
+ * Prefixes the (compressed) firmware with its exact uncompressed size, the
+ * codec used and a SHA1 digest of the payload following the header, so
+ * corrupt firmware is rejected before any decompression or parsing work.
+ * Header-less zlib and uncompressed firmwares are still accepted.
+ */
+#define kBrcmFirmwareContainerMagic   0x5a525042 // 'BPRZ'
+#define kBrcmFirmwareContainerVersion 1
+
+#define kBrcmFirmwareCodecNone 0
+#define kBrcmFirmwareCodecZlib 1
+#define kBrcmFirmwareCodecLZ4  2 // Single LZ4 block, faster to decode than zlib
+#define kBrcmFirmwareCodecDelta 3 // Delta against a chip family base firmware
+
+typedef struct __attribute__((packed)) BrcmFirmwareContainerHeader
+{
+    UInt32 magic;
+    UInt16 version;
+    UInt16 headerSize;
+    UInt32 codec;
+    UInt32 uncompressedSize;
+    UInt32 compressedSize;
+    UInt8 digest[20];
+} BrcmFirmwareContainerHeader;
+
+/*
+ * Payload of kBrcmFirmwareCodecDelta, followed by zlib compressed operations
+ *
+ * Each operation is a varint insert length, the inserted bytes, then a varint
+ * offset and length of data copied from the base firmware. The base is
+ * another (non-delta) container stored under baseName.
+ */
+typedef struct __attribute__((packed)) BrcmFirmwareDeltaHeader
+{
+    char baseName[32];
+    UInt8 baseDigest[20];
+    UInt32 operationsSize;
+} BrcmFirmwareDeltaHeader;
+
+/*
+ * Iterates the instructions of a (validated) patch stream in place
+ */
+class BrcmPatchStreamIterator
+{
+private:
+    const UInt8* mData = NULL;
+    const UInt8* mIndex = NULL;
+    UInt32 mDataSize = 0;
+    UInt32 mCount = 0;
+    UInt32 mNext = 0;
+
+public:
+    void reset(OSData* patchStream)
+    {
+        mData = mIndex = NULL;
+        mDataSize = mCount = mNext = 0;
+
+        if (!patchStream || patchStream->getLength() < sizeof(BrcmPatchStreamHeader))
+            return;
+
+        const BrcmPatchStreamHeader* header = (const BrcmPatchStreamHeader*)patchStream->getBytesNoCopy();
+        mData = (const UInt8*)header + header->headerSize;
+        mDataSize = header->dataSize;
+        mIndex = mData + mDataSize;
+        mCount = header->recordCount;
+    }
+
+    bool isValid() const { return mData != NULL; }
+    UInt32 getCount() const { return mCount; }
+    void seek(UInt32 index) { mNext = index < mCount ? index : mCount; }
+
+    bool getNextInstruction(const UInt8* &instruction, UInt16 &length)
+    {
+        if (mNext >= mCount)
+            return false;
+
+        UInt32 offset = OSReadLittleInt32(mIndex, mNext * sizeof(UInt32));
+        mNext++;
+        UInt32 end = mNext < mCount ? OSReadLittleInt32(mIndex, mNext * sizeof(UInt32)) : mDataSize;
+
+        instruction = mData + offset;
+        length = end - offset;
+        return true;
+    }
+};
+
+class FirmwareParser;
+
+/*
+ * zlib workspace owned by the store, one slot per size class, reset between loads
+ */
+struct BrcmZlibArena
+{
+    UInt8* slots[kBrcmZlibArenaClasses];
+    bool slotUsed[kBrcmZlibArenaClasses];
+    bool busy;
+    UInt32 used;
+};
+
 class BrcmFirmwareStore : public IOService
 {
 private:
     typedef IOService super;
     OSDeclareDefaultStructors(BrcmFirmwareStore);
 
+    // Decodes a resource straight out of the borrowed callback buffer, returns false if it has to be copied instead
+    typedef bool (BrcmFirmwareStore::*ResourceDecoder)(OSData* resource, OSData* &result);
+
     struct ResourceCallbackContext
     {
         BrcmFirmwareStore* me;
         OSData* firmware;
+        const char* path;
+        OSDictionary* manifestEntry;
+        ResourceDecoder decoder;
+        bool decoded;
+        bool completed;
+        OSReturn result;
     };
 
     IOLock* mDataLock;
+    BrcmZlibArena mZlibArenas[kBrcmZlibArenaCount] = {};
+    UInt32 mZlibArenaHighWater = 0;
     OSDictionary* mFirmwares;
+    OSDictionary* mCoalescedFirmwares;
+    OSDictionary* mLoadingFirmwares;
+    OSDictionary* mMissingFirmwares;
+    OSObject* mMissingFirmwaresSource = NULL;
+    UInt32 mMissingFirmwareHits = 0;
+    UInt32 mMissingFirmwareMisses = 0;
+    UInt64 mMissingFirmwareTTL = 0;
+    OSDictionary* mManifest = NULL;
+    bool mManifestLoaded = false;
+    bool mManifestLoading = false;
     IOLock* mCompletionLock = NULL;
 
-    OSData* decompressFirmware(OSData* firmware);
-    OSArray* parseFirmware(OSData* firmwareData);
+    BrcmZlibArena* acquireZlibArena();
+    void releaseZlibArena(BrcmZlibArena* arena);
+    bool decompressFirmware(const void* data, UInt32 length, FirmwareParser &parser);
+    bool decompressFirmwareLZ4(const void* data, UInt32 length, UInt32 uncompressedSize, FirmwareParser &parser);
+    bool decompressFirmwareDelta(const void* data, UInt32 length, FirmwareParser &parser);
+    OSData* decodeFirmwareBase(OSData* firmware);
+    bool decodeBaseResource(OSData* resource, OSData* &result);
+    OSData* loadFirmwareBase(const char* baseName);
+    bool decodeFirmware(const BrcmFirmwareContainerHeader* container, FirmwareParser &parser);
+    OSData* parseFirmware(OSData* firmware);
+    bool parseResource(OSData* resource, OSData* &result);
+    OSData* parsePatchStream(OSData* firmwareData);
+    OSData* coalesceFirmware(OSData* instructions);
     static void requestResourceCallback(OSKextRequestTag requestTag, OSReturn result, const void * resourceData, uint32_t resourceDataLength, void* context);
-    OSData* loadFirmwareFile(const char* filename, const char* suffix);
-    OSData* loadFirmwareFiles(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier);
-    OSArray* loadFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier);
+    OSData* requestResource(const char* path, OSDictionary* manifestEntry, ResourceDecoder decoder, bool &decoded, bool &missing);
+    OSDictionary* getManifest();
+    OSData* loadFirmwareFile(const char* filename, const char* suffix, ResourceDecoder decoder, bool &decoded, bool &missing);
+    OSData* loadFirmwareFiles(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier, bool &parsed, bool &missing);
+    OSData* loadFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier, bool &missing);
+    bool isFirmwareMissing(const char* names);
 
 public:
     bool start(IOService *provider) override;
     void stop(IOService *provider) override;
 
-    virtual OSArray* getFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier);
+    virtual OSData* getFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier, bool coalesce = false);
 };
 
 #endif /* defined(__BrcmPatchRAM__BrcmFirmwareStore__) */
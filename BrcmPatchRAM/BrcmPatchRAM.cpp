@@ -67,6 +67,12 @@ static IOPMPowerState myTwoStates[2] =
  * they should be added to the list. It might be possible that this
  * is a common feature among Broadcom BT controllers making the list
  * obsolete, but for now, we still need it.
+ *
+ * Devices not in the list are probed for the mechanism: after the
+ * firmware has been written the driver waits up to mPreResetDelay for
+ * the vendor event and resets the device as soon as it arrives. The
+ * outcome is stored in the kHandshakeSupported property of the USB
+ * device, so following uploads (e.g. on wakeup) skip the detection.
  */
 static DeviceHskSupport hskSupport[] =
 {
@@ -87,9 +93,7 @@ OSString* BrcmPatchRAM::brcmBundleIdentifier = NULL;
 OSString* BrcmPatchRAM::brcmIOClass = NULL;
 OSString* BrcmPatchRAM::brcmProviderClass = NULL;
 
-#ifndef NON_RESIDENT
-IOLock* BrcmPatchRAM::mLoadFirmwareLock = IOLockAlloc();
-#endif
+IOLock* BrcmPatchRAM::mPersonalityLock = NULL;
 
 extern "C"
 {
@@ -97,10 +101,8 @@ extern "C"
 __attribute__((visibility("hidden")))
 kern_return_t BrcmPatchRAM_Start(kmod_info_t* ki, void * d)
 {
-#ifndef NON_RESIDENT
-    if (!(BrcmPatchRAM::mLoadFirmwareLock = IOLockAlloc()))
+    if (!(BrcmPatchRAM::mPersonalityLock = IOLockAlloc()))
         return KERN_FAILURE;
-#endif
 
     return KERN_SUCCESS;
 }
@@ -108,13 +110,11 @@ kern_return_t BrcmPatchRAM_Start(kmod_info_t* ki, void * d)
 __attribute__((visibility("hidden")))
 kern_return_t BrcmPatchRAM_Stop(kmod_info_t* ki, void * d)
 {
-#ifndef NON_RESIDENT
-    if (BrcmPatchRAM::mLoadFirmwareLock)
+    if (BrcmPatchRAM::mPersonalityLock)
     {
-        IOLockFree(BrcmPatchRAM::mLoadFirmwareLock);
-        BrcmPatchRAM::mLoadFirmwareLock = NULL;
+        IOLockFree(BrcmPatchRAM::mPersonalityLock);
+        BrcmPatchRAM::mPersonalityLock = NULL;
     }
-#endif
 
     return KERN_SUCCESS;
 }
@@ -204,14 +204,21 @@ IOService* BrcmPatchRAM::probe(IOService *provider, SInt32 *probeScore)
     if (!mWorkLock)
         return NULL;
 
-    // Note: mLoadFirmwareLock is static (global), not instance data...
-    if (!mLoadFirmwareLock)
+    // Note: per instance, so devices are patched in parallel
+    if (!mUploadLock && !(mUploadLock = IOLockAlloc()))
         return NULL;
 #endif
 
+    // Note: mPersonalityLock is static (global), not instance data...
+    if (!mPersonalityLock)
+        return NULL;
+
     mCompletionLock = IOLockAlloc();
     if (!mCompletionLock)
         return NULL;
+    mEventLock = IOLockAlloc();
+    if (!mEventLock)
+        return NULL;
 
     mDevice.setDevice(provider);
     if (!mDevice.getValidatedDevice())
@@ -256,6 +263,70 @@ IOService* BrcmPatchRAM::probe(IOService *provider, SInt32 *probeScore)
     if (PE_parse_boot_argn("bpr_preresetdelay", &delay, sizeof delay))
         mPreResetDelay = delay;
 
+    // Maximum number of LAUNCH_RAM commands in flight, further limited by the controller
+    mCommandWindow = 1;
+    if (OSNumber* commandWindow = OSDynamicCast(OSNumber, getProperty("CommandWindow")))
+        mCommandWindow = commandWindow->unsigned32BitValue();
+    if (PE_parse_boot_argn("bpr_commandwindow", &delay, sizeof delay))
+        mCommandWindow = delay;
+    if (mCommandWindow < 1)
+        mCommandWindow = 1;
+    // round trips are only timed for this many records in flight
+    if (mCommandWindow > kRoundTripTracked)
+        mCommandWindow = kRoundTripTracked;
+
+    // Merge contiguous firmware records into larger LAUNCH_RAM commands
+    mCoalesceRecords = false;
+    if (OSBoolean* coalesceRecords = OSDynamicCast(OSBoolean, getProperty("CoalesceRecords")))
+        mCoalesceRecords = coalesceRecords->isTrue();
+    if (PE_parse_boot_argn("bpr_coalesce", &delay, sizeof delay))
+        mCoalesceRecords = delay != 0;
+
+    // When to decode the firmware: lazily, in probe, or on a background thread
+    mFirmwarePrefetch = kFirmwarePrefetchProbe;
+    if (OSNumber* firmwarePrefetch = OSDynamicCast(OSNumber, getProperty("FirmwarePrefetch")))
+        mFirmwarePrefetch = firmwarePrefetch->unsigned32BitValue();
+    if (PE_parse_boot_argn("bpr_prefetch", &delay, sizeof delay))
+        mFirmwarePrefetch = delay;
+    if (mFirmwarePrefetch > kFirmwarePrefetchBackground)
+    {
+        AlwaysLog("Invalid FirmwarePrefetch %u, using %u.\n", mFirmwarePrefetch, kFirmwarePrefetchProbe);
+        mFirmwarePrefetch = kFirmwarePrefetchProbe;
+    }
+
+    // Poll the controller for readiness instead of sleeping the full reset/minidriver delays
+    mAdaptiveDelays = false;
+    if (OSBoolean* adaptiveDelays = OSDynamicCast(OSBoolean, getProperty("AdaptiveDelays")))
+        mAdaptiveDelays = adaptiveDelays->isTrue();
+    if (PE_parse_boot_argn("bpr_adaptive", &delay, sizeof delay))
+        mAdaptiveDelays = delay != 0;
+
+    // Send the next firmware records from the completion handler instead of the upload thread
+    mAsyncUpload = false;
+    if (OSBoolean* asyncUpload = OSDynamicCast(OSBoolean, getProperty("AsyncUpload")))
+        mAsyncUpload = asyncUpload->isTrue();
+    if (PE_parse_boot_argn("bpr_async", &delay, sizeof delay))
+        mAsyncUpload = delay != 0;
+
+    // Bound every wait for the device: per response, retries per state and the whole upload
+    mResponseTimeout = 1000;
+    if (OSNumber* responseTimeout = OSDynamicCast(OSNumber, getProperty("ResponseTimeout")))
+        mResponseTimeout = responseTimeout->unsigned32BitValue();
+    if (PE_parse_boot_argn("bpr_timeout", &delay, sizeof delay))
+        mResponseTimeout = delay;
+
+    mResponseRetries = 2;
+    if (OSNumber* responseRetries = OSDynamicCast(OSNumber, getProperty("ResponseRetries")))
+        mResponseRetries = responseRetries->unsigned32BitValue();
+    if (PE_parse_boot_argn("bpr_retries", &delay, sizeof delay))
+        mResponseRetries = delay;
+
+    mUploadTimeout = 10000;
+    if (OSNumber* uploadTimeout = OSDynamicCast(OSNumber, getProperty("UploadTimeout")))
+        mUploadTimeout = uploadTimeout->unsigned32BitValue();
+    if (PE_parse_boot_argn("bpr_uploadtimeout", &delay, sizeof delay))
+        mUploadTimeout = delay;
+
     if (OSString* displayName = OSDynamicCast(OSString, getProperty(kDisplayName)))
         provider->setProperty(kUSBProductString, displayName);
     
@@ -264,19 +335,21 @@ IOService* BrcmPatchRAM::probe(IOService *provider, SInt32 *probeScore)
 
     // Check if device supports handshake.
     int handshake;
+    mDetectHandshake = false;
     if (PE_parse_boot_argn("bpr_handshake", &handshake, sizeof handshake))
         mSupportsHandshake = handshake != 0;
+    else if (OSBoolean* learned = OSDynamicCast(OSBoolean, mDevice.getProperty(kHandshakeSupported)))
+        mSupportsHandshake = learned->isTrue();
     else
+    {
         mSupportsHandshake = supportsHandshake(mVendorId, mProductId);
+        mDetectHandshake = !mSupportsHandshake;
+    }
 
-    DebugLog("Device %s handshake.\n", mSupportsHandshake ? "supports" : "doesn't support");
+    DebugLog("Device %s handshake.\n", mDetectHandshake ? "may support" : mSupportsHandshake ? "supports" : "doesn't support");
 
     // get firmware here to pre-cache for eventual use on wakeup or now
-    if (OSString* firmwareKey = OSDynamicCast(OSString, getProperty(kFirmwareKey)))
-    {
-        if (BrcmFirmwareStore* firmwareStore = getFirmwareStore())
-            firmwareStore->getFirmware(mVendorId, mProductId, firmwareKey);
-    }
+    prefetchFirmware(mFirmwarePrefetch);
 
     IOSleep(mProbeDelay);
 
@@ -368,7 +441,7 @@ void BrcmPatchRAM::stop(IOService* provider)
     mStopping = true;
 
     // allow firmware load already started to finish
-    IOLockLock(mLoadFirmwareLock);
+    IOLockLock(mUploadLock);
 
     OSSafeReleaseNULL(mFirmwareStore);
 
@@ -393,11 +466,6 @@ void BrcmPatchRAM::stop(IOService* provider)
 
     PMstop();
 
-    if (mCompletionLock)
-    {
-        IOLockFree(mCompletionLock);
-        mCompletionLock = NULL;
-    }
 #ifndef NON_RESIDENT
     if (mWorkLock)
     {
@@ -405,7 +473,7 @@ void BrcmPatchRAM::stop(IOService* provider)
         mWorkLock = NULL;
     }
 
-    IOLockUnlock(mLoadFirmwareLock);
+    IOLockUnlock(mUploadLock);
 #endif // #ifndef NON_RESIDENT
 
     mDevice.setDevice(NULL);
@@ -415,6 +483,31 @@ void BrcmPatchRAM::stop(IOService* provider)
     super::stop(provider);
 }
 
+void BrcmPatchRAM::free()
+{
+    DebugLog("free\n");
+
+    // kept until here, an uploader thread may still try it after stop
+    if (mUploadLock)
+    {
+        IOLockFree(mUploadLock);
+        mUploadLock = NULL;
+    }
+    // a write the upload gave up on may still complete after stop
+    if (mCompletionLock)
+    {
+        IOLockFree(mCompletionLock);
+        mCompletionLock = NULL;
+    }
+    if (mEventLock)
+    {
+        IOLockFree(mEventLock);
+        mEventLock = NULL;
+    }
+
+    super::free();
+}
+
 IOReturn BrcmPatchRAM::onTimerEvent()
 {
     DebugLog("onTimerEvent\n");
@@ -474,15 +567,15 @@ void BrcmPatchRAM::uploadFirmwareThread(void *arg, wait_result_t wait)
     DebugLog("sendFirmwareThread enter\n");
 
     // don't start firmware load when lock is held (instance is shutting down)
-    if (IOLockTryLock(mLoadFirmwareLock))
+    BrcmPatchRAM* me = static_cast<BrcmPatchRAM*>(arg);
+    if (IOLockTryLock(me->mUploadLock))
     {
-        BrcmPatchRAM* me = static_cast<BrcmPatchRAM*>(arg);
         me->uploadFirmware();
 #ifndef TARGET_ELCAPITAN
         me->publishPersonality();
 #endif
         me->scheduleWork(kWorkFinished);
-        IOLockUnlock(mLoadFirmwareLock);
+        IOLockUnlock(me->mUploadLock);
     }
 
     DebugLog("sendFirmwareThread termination\n");
@@ -530,7 +623,9 @@ void BrcmPatchRAM::uploadFirmware()
                         AlwaysLog("[%04x:%04x]: Firmware upgrade not needed.\n", mVendorId, mProductId);
                 else
                     AlwaysLog("[%04x:%04x]: Firmware upgrade failed.\n", mVendorId, mProductId);
-                OSSafeReleaseNULL(mReadBuffer); // mReadBuffer is allocated by performUpgrade but not released
+                // mReadBuffers are allocated by performUpgrade but not released
+                for (UInt32 i = 0; i < kReadBufferCount; i++)
+                    OSSafeReleaseNULL(mReadBuffers[i]);
             }
             mInterface.close(this);
         }
@@ -657,6 +752,7 @@ void BrcmPatchRAM::removePersonality()
     setNumberInDict(dict, kUSBProductID, mProductId);
     setNumberInDict(dict, kUSBVendorID, mVendorId);
     dict->setObject(kBundleIdentifier, brcmBundleIdentifier);
+    IOLockLock(mPersonalityLock);
     gIOCatalogue->removeDrivers(dict, false); // no nub matching on removal
 
     // remove generic matching personality
@@ -667,6 +763,7 @@ void BrcmPatchRAM::removePersonality()
     setNumberInDict(dict, "bDeviceProtocol", 1);
     setNumberInDict(dict, "bDeviceSubClass", 1);
     gIOCatalogue->removeDrivers(dict, false); // no nub matching on removal
+    IOLockUnlock(mPersonalityLock);
 
     dict->release();
     
@@ -687,9 +784,10 @@ void BrcmPatchRAM::publishPersonality()
     setNumberInDict(dict, kUSBProductID, mProductId);
     setNumberInDict(dict, kUSBVendorID, mVendorId);
 
-    // Retrieve currently matching IOKit driver personalities
+    // Retrieve currently matching IOKit driver personalities, another instance may be publishing them
     OSDictionary* personality = NULL;
     SInt32 generationCount;
+    IOLockLock(mPersonalityLock);
     if (OSOrderedSet* set = gIOCatalogue->findDrivers(dict, &generationCount))
     {
         if (set->getCount())
@@ -748,6 +846,7 @@ void BrcmPatchRAM::publishPersonality()
             array->release();
         }
     }
+    IOLockUnlock(mPersonalityLock);
     dict->release();
 
 #ifdef DEBUG
@@ -764,9 +863,10 @@ bool BrcmPatchRAM::publishResourcePersonality(const char* classname)
     setStringInDict(dict, kIOClassKey, classname);
     setStringInDict(dict, kIOMatchCategoryKey, classname);
 
-    // retrieve currently matching IOKit driver personalities
+    // retrieve currently matching IOKit driver personalities, another instance may be publishing them
     OSDictionary* personality = NULL;
     SInt32 generationCount;
+    IOLockLock(mPersonalityLock);
     if (OSOrderedSet* set = gIOCatalogue->findDrivers(dict, &generationCount))
     {
         if (set->getCount())
@@ -783,6 +883,7 @@ bool BrcmPatchRAM::publishResourcePersonality(const char* classname)
     // if we don't find it, then something is really wrong...
     if (!personality)
     {
+        IOLockUnlock(mPersonalityLock);
         AlwaysLog("unable to find disabled %s personality.\n", classname);
         dict->release();
         return false;
@@ -796,6 +897,7 @@ bool BrcmPatchRAM::publishResourcePersonality(const char* classname)
 		{
 			coll->release();
 		}
+		IOLockUnlock(mPersonalityLock);
 		dict->release();
         AlwaysLog("copyCollection failed.");
         return false;
@@ -817,6 +919,7 @@ bool BrcmPatchRAM::publishResourcePersonality(const char* classname)
             AlwaysLog("ERROR in addDrivers for new %s personality.\n", classname);
         array->release();
     }
+    IOLockUnlock(mPersonalityLock);
     personality->release();
 
     return true;
@@ -871,6 +974,54 @@ BrcmFirmwareStore* BrcmPatchRAM::getFirmwareStore()
     return mFirmwareStore;
 }
 
+void BrcmPatchRAM::prefetchFirmware(UInt32 prefetch)
+{
+    OSString* firmwareKey = OSDynamicCast(OSString, getProperty(kFirmwareKey));
+    if (!firmwareKey || prefetch == kFirmwarePrefetchNone)
+        return;
+
+    // resolve the store here, so the worker thread never races on mFirmwareStore
+    BrcmFirmwareStore* firmwareStore = getFirmwareStore();
+    if (!firmwareStore)
+        return;
+
+    if (prefetch == kFirmwarePrefetchBackground)
+    {
+        thread_t thread;
+        retain();
+        firmwareStore->retain();
+        if (KERN_SUCCESS == kernel_thread_start(&BrcmPatchRAM::prefetchFirmwareThread, this, &thread))
+        {
+            // the thread holds its own reference
+            thread_deallocate(thread);
+            return;
+        }
+        AlwaysLog("[%04x:%04x]: ERROR creating firmware prefetch thread.\n", mVendorId, mProductId);
+        firmwareStore->release();
+        release();
+    }
+
+    firmwareStore->getFirmware(mVendorId, mProductId, firmwareKey, mCoalesceRecords);
+}
+
+void BrcmPatchRAM::prefetchFirmwareThread(void* arg, wait_result_t wait)
+{
+    BrcmPatchRAM* me = static_cast<BrcmPatchRAM*>(arg);
+    BrcmFirmwareStore* firmwareStore = me->mFirmwareStore;
+
+    DebugLog("[%04x:%04x]: prefetchFirmwareThread enter\n", me->mVendorId, me->mProductId);
+
+    // a concurrent getFirmware for the same key waits for this load instead of repeating it
+    if (OSString* firmwareKey = OSDynamicCast(OSString, me->getProperty(kFirmwareKey)))
+        firmwareStore->getFirmware(me->mVendorId, me->mProductId, firmwareKey, me->mCoalesceRecords);
+
+    DebugLog("[%04x:%04x]: prefetchFirmwareThread termination\n", me->mVendorId, me->mProductId);
+
+    firmwareStore->release();
+    me->release();
+    thread_terminate(current_thread());
+}
+
 void BrcmPatchRAM::printDeviceInfo()
 {
     char product[255];
@@ -1003,50 +1154,124 @@ bool BrcmPatchRAM::findPipe(USBPipeShim* shim, UInt8 type, UInt8 direction)
 
 bool BrcmPatchRAM::continuousRead()
 {
-    if (!mReadBuffer)
+    for (UInt32 i = 0; i < kReadBufferCount; i++)
     {
-        mReadBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, 0x200);
-        if (!mReadBuffer)
+        if (mReadsQueued & (1 << i))
+            continue;
+
+        if (!mReadBuffers[i])
         {
-            AlwaysLog("[%04x:%04x]: continuousRead - failed to allocate read buffer.\n", mVendorId, mProductId);
-            return false;
-        }
+            mReadBuffers[i] = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, kReadBufferSize);
+            if (!mReadBuffers[i])
+            {
+                AlwaysLog("[%04x:%04x]: continuousRead - failed to allocate read buffer.\n", mVendorId, mProductId);
+                break;
+            }
 #ifndef TARGET_ELCAPITAN
-        mInterruptCompletion.target = this;
+            mReadCompletions[i].target = this;
 #else
-        mInterruptCompletion.owner = this;
+            mReadCompletions[i].owner = this;
 #endif
-        mInterruptCompletion.action = readCompletion;
-        mInterruptCompletion.parameter = NULL;
+            mReadCompletions[i].action = readCompletion;
+            mReadCompletions[i].parameter = (void*)(uintptr_t)i;
+        }
+
+        // marked before it is queued, its completion may come first
+        OSBitOrAtomic(1 << i, &mReadsQueued);
+        if (!queueRead(i))
+            OSBitAndAtomic(~(1 << i), &mReadsQueued);
     }
 
-    IOReturn result = mReadBuffer->prepare();
+    return mReadsQueued != 0;
+}
+
+bool BrcmPatchRAM::queueRead(UInt32 index)
+{
+    IOBufferMemoryDescriptor* buffer = mReadBuffers[index];
+
+    IOReturn result = buffer->prepare();
     if (result != kIOReturnSuccess)
     {
         AlwaysLog("[%04x:%04x]: continuousRead - failed to prepare buffer (0x%08x)\n", mVendorId, mProductId, result);
         return false;
     }
 
-    if ((result = mInterruptPipe.read(mReadBuffer, 0, 0, mReadBuffer->getLength(), &mInterruptCompletion)) != kIOReturnSuccess)
+    if ((result = mInterruptPipe.read(buffer, 0, 0, buffer->getLength(), &mReadCompletions[index])) != kIOReturnSuccess)
     {
         AlwaysLog("[%04x:%04x]: continuousRead - Failed to queue read (0x%08x)\n", mVendorId, mProductId, result);
 
         if (result == kIOUSBPipeStalled)
         {
             mInterruptPipe.clearStall();
-            result = mInterruptPipe.read(mReadBuffer, 0, 0, mReadBuffer->getLength(), &mInterruptCompletion);
+            result = mInterruptPipe.read(buffer, 0, 0, buffer->getLength(), &mReadCompletions[index]);
             
             if (result != kIOReturnSuccess)
-            {
                 AlwaysLog("[%04x:%04x]: continuousRead - Failed, read dead (0x%08x)\n", mVendorId, mProductId, result);
-                return false;
-            }
         }
     }
 
+    if (result != kIOReturnSuccess)
+        buffer->complete();
+
+    return result == kIOReturnSuccess;
+}
+
+bool BrcmPatchRAM::pushEvent(const void* data, UInt32 length)
+{
+    UInt32 head = mEventRing.head;
+    
+    if (head - mEventRing.tail >= kEventRingSize)
+        return false;
+    
+    HciEvent* event = &mEventRing.events[head % kEventRingSize];
+    if (length > sizeof(event->data))
+        length = sizeof(event->data);
+    memcpy(event->data, data, length);
+    event->length = length;
+    
+    // publish the event only once its contents are visible
+    OSMemoryBarrier();
+    mEventRing.head = head + 1;
     return true;
 }
 
+bool BrcmPatchRAM::processEvents()
+{
+    bool wakeup = false;
+    
+    while (mEventRing.tail != mEventRing.head)
+    {
+        OSMemoryBarrier();
+        HciEvent* event = &mEventRing.events[mEventRing.tail % kEventRingSize];
+        hciParseResponse(event->data, event->length, NULL, NULL);
+        OSMemoryBarrier();
+        mEventRing.tail++;
+        
+        // late readiness reply or unexpected vendor event, keep waiting for the response the state machine expects
+        if (mIgnoredEvent)
+        {
+            mIgnoredEvent = false;
+            continue;
+        }
+        // completion driven upload, send the next records from here and only wake
+        // the upload thread once they are all acknowledged (or anything goes wrong)
+        if (mAsyncUpload && mDeviceState == kInstructionWritten)
+        {
+            mDeviceState = kInstructionWrite;
+            if (!writeInstructions())
+            {
+                if (!resumeInstructions())
+                    mDeviceState = kUpdateAborted;
+            }
+            else if (!(mInstructionsDone && mCommandsInFlight == 0))
+                continue;
+        }
+        wakeup = true;
+    }
+    
+    return wakeup;
+}
+
 #ifndef TARGET_ELCAPITAN
 void BrcmPatchRAM::readCompletion(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining)
 #else
@@ -1054,48 +1279,140 @@ void BrcmPatchRAM::readCompletion(void* target, void* parameter, IOReturn status
 #endif
 {
     BrcmPatchRAM *me = (BrcmPatchRAM*)target;
+    UInt32 index = (UInt32)(uintptr_t)parameter;
+    IOBufferMemoryDescriptor* buffer = me->mReadBuffers[index];
+    UInt32 signals = kEventsReadError;
+    bool requeued = false;
 
-    IOLockLock(me->mCompletionLock);
-
-    IOReturn result = me->mReadBuffer->complete();
+    IOReturn result = buffer->complete();
     if (result != kIOReturnSuccess)
         DebugLog("[%04x:%04x]: ReadCompletion failed to complete read buffer (\"%s\" 0x%08x).\n", me->mVendorId, me->mProductId, me->stringFromReturn(result), result);
 
+    // Never wait for mCompletionLock here, this runs on the USB workloop. Copy the event into the
+    // ring, put the buffer straight back on the pipe and leave everything else to the upload thread.
     switch (status)
     {
         case kIOReturnSuccess:
 #ifndef TARGET_ELCAPITAN
-            me->hciParseResponse(me->mReadBuffer->getBytesNoCopy(), me->mReadBuffer->getLength() - bufferSizeRemaining, NULL, NULL);
+            if (!me->pushEvent(buffer->getBytesNoCopy(), buffer->getLength() - bufferSizeRemaining))
 #else
-            me->hciParseResponse(me->mReadBuffer->getBytesNoCopy(), bytesTransferred, NULL, NULL);
+            if (!me->pushEvent(buffer->getBytesNoCopy(), bytesTransferred))
 #endif
+                AlwaysLog("[%04x:%04x]: readCompletion - Event ring full, event dropped.\n", me->mVendorId, me->mProductId);
+            requeued = !me->mReapingReads && me->queueRead(index);
+            signals = kEventsPushed;
             break;
         case kIOReturnAborted:
+            // reads are aborted on purpose once the upload is over
+            if (me->mReapingReads)
+            {
+                signals = 0;
+                break;
+            }
             AlwaysLog("[%04x:%04x]: readCompletion - Return aborted (0x%08x)\n", me->mVendorId, me->mProductId, status);
-            me->mDeviceState = kUpdateAborted;
             break;
         case kIOReturnNoDevice:
             AlwaysLog("[%04x:%04x]: readCompletion - No such device (0x%08x)\n", me->mVendorId, me->mProductId, status);
-            me->mDeviceState = kUpdateAborted;
             break;
         case kIOUSBTransactionTimeout:
             AlwaysLog("[%04x:%04x]: readCompletion - Transaction timeout (0x%08x)\n", me->mVendorId, me->mProductId, status);
             break;
         case kIOReturnNotResponding:
             AlwaysLog("[%04x:%04x]: Not responding - Delaying next read.\n", me->mVendorId, me->mProductId);
-            me->mInterruptPipe.clearStall();
-            me->mDeviceState = kUpdateAborted;
             break;
         default:
             AlwaysLog("[%04x:%04x]: readCompletion - Unknown error (0x%08x)\n", me->mVendorId, me->mProductId, status);
-            me->mDeviceState = kUpdateAborted;
             break;
     }
 
-    IOLockUnlock(me->mCompletionLock);
+    // only wake for a lost read if it was the last one queued
+    if (!requeued && OSBitAndAtomic(~(1 << index), &me->mReadsQueued) == (1U << index))
+        signals |= kEventsWakeup;
+
+    // Completion driven upload, advance the state machine right here while the upload thread
+    // waits, and only wake it once that is needed. If it is busy, it parses the events itself.
+    if (signals == kEventsPushed && me->mAsyncUpload && IOLockTryLock(me->mCompletionLock))
+    {
+        bool wakeup = me->processEvents();
+        IOLockUnlock(me->mCompletionLock);
+        if (!wakeup)
+            return;
+        signals = kEventsWakeup;
+    }
+    me->signalEvents(signals, status);
+}
+
+void BrcmPatchRAM::signalEvents(UInt32 signals, IOReturn status)
+{
+    if (!signals)
+        return;
+
+    IOLockLock(mEventLock);
+    mEventSignals |= signals;
+    if (signals & kEventsReadError)
+        mReadStatus = status;
+    if (signals & kEventsWriteError)
+        mWriteStatus = status;
+    IOLockWakeup(mEventLock, &mEventSignals, true);
+    IOLockUnlock(mEventLock);
+}
+
+int BrcmPatchRAM::waitForEvents(uint64_t deadline)
+{
+    IOReturn readStatus, writeStatus;
+    UInt32 signals;
+    int result;
+
+    // Called and returns with mCompletionLock held, but sleeps on mEventLock, the only lock
+    // the completions take. Events that leave the state machine where it was keep it waiting.
+    do
+    {
+        IOLockUnlock(mCompletionLock);
+        IOLockLock(mEventLock);
+        result = THREAD_AWAKENED;
+        if (!mEventSignals)
+            result = IOLockSleepDeadline(mEventLock, &mEventSignals, deadline, THREAD_UNINT);
+        signals = mEventSignals;
+        readStatus = mReadStatus;
+        writeStatus = mWriteStatus;
+        mEventSignals = 0;
+        mReadStatus = mWriteStatus = kIOReturnSuccess;
+        IOLockUnlock(mEventLock);
+        IOLockLock(mCompletionLock);
+
+        processErrors(signals, readStatus, writeStatus);
+        if (processEvents() || (signals & ~kEventsPushed))
+            return THREAD_AWAKENED;
+    } while (result != THREAD_TIMED_OUT);
+
+    return THREAD_TIMED_OUT;
+}
 
-    // wake waiting task in performUpgrade (in IOLockSleep)...
-    IOLockWakeup(me->mCompletionLock, me, true);
+void BrcmPatchRAM::processErrors(UInt32 signals, IOReturn readStatus, IOReturn writeStatus)
+{
+    if (signals & kEventsReadError)
+    {
+        switch (readStatus)
+        {
+            case kIOUSBTransactionTimeout:
+                break;
+            case kIOReturnNotResponding:
+                // the upload thread clears the stall before it resends the records
+                if (resumeInstructions())
+                    break;
+                mInterruptPipe.clearStall();
+                mDeviceState = kUpdateAborted;
+                break;
+            default:
+                mDeviceState = kUpdateAborted;
+                break;
+        }
+    }
+    if (signals & kEventsWriteError)
+    {
+        if (mReapingWrites || !resumeInstructions())
+            mDeviceState = kUpdateAborted;
+    }
 }
 
 IOReturn BrcmPatchRAM::hciCommand(void * command, UInt16 length)
@@ -1118,8 +1435,17 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
         {
             HCI_COMMAND_COMPLETE* event = (HCI_COMMAND_COMPLETE*)response;
             
+            // Number of HCI command packets the controller is able to accept now
+            mCommandCredits = event->numCommands;
+            
             switch (event->opcode)
             {
+                case HCI_OPCODE_NOP:
+                    DebugLog("[%04x:%04x]: NOP complete (credits: %d).\n", mVendorId, mProductId, event->numCommands);
+                    // no command completed, the controller only returns credits
+                    if (mDeviceState == kInstructionWrite && mCommandsInFlight < mCommandCredits)
+                        mDeviceState = kInstructionWritten;
+                    break;
                 case HCI_OPCODE_READ_VERBOSE_CONFIG:
                     DebugLog("[%04x:%04x]: READ VERBOSE CONFIG complete (status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->status, header->length);
@@ -1145,7 +1471,17 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
                     //DebugLog("[%04x:%04x]: LAUNCH RAM complete (status: 0x%02x, length: %d bytes).\n",
                     //          mVendorId, mProductId, event->status, header->length);
                     
-                    mDeviceState = kInstructionWritten;
+                    if (mCommandsInFlight > 0)
+                        mCommandsInFlight--;
+                    // with nothing in flight every record sent is acknowledged, this is where a resume starts
+                    if (mCommandsInFlight == 0)
+                        mInstructionsCheckpoint = mInstructionsSent;
+                    mRecordsAcknowledged++;
+                    recordRoundTrip();
+                    
+                    // replies still coming in ahead of the resume barrier only move the checkpoint
+                    if (mDeviceState != kInstructionResume)
+                        mDeviceState = kInstructionWritten;
                     break;
                 case HCI_OPCODE_END_OF_RECORD:
                     DebugLog("[%04x:%04x]: END OF RECORD complete (status: 0x%02x, length: %d bytes).\n",
@@ -1153,6 +1489,28 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
                     
                     mDeviceState = kFirmwareWritten;
                     break;
+                case HCI_OPCODE_READ_LOCAL_COMMANDS:
+                    // every record sent before the barrier is answered or lost, resend from the checkpoint
+                    if (mResumeBarrier)
+                    {
+                        DebugLog("[%04x:%04x]: Resending firmware from record %u.\n", mVendorId, mProductId, mInstructionsCheckpoint);
+                        mResumeBarrier = false;
+                        mInstructions.seek(mInstructionsCheckpoint);
+                        mInstructionsSent = mInstructionsCheckpoint;
+                        mInstructionsDone = false;
+                        mCommandsInFlight = 0;
+                        mStatistics.recordsAnswered = mStatistics.recordsSent;
+                        mDeviceState = kInstructionWrite;
+                    }
+                    break;
+                case HCI_OPCODE_LOCAL_VERSION:
+                    if (mReadinessPolls > 0)
+                        mReadinessPolls--;
+                    if (event->status == 0)
+                        mControllerReady = true;
+                    
+                    mIgnoredEvent = !mReadinessPolling;
+                    break;
                 case HCI_OPCODE_RESET:
                     DebugLog("[%04x:%04x]: RESET complete (status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->status, header->length);
@@ -1183,6 +1541,17 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
             }
             break;
         }
+        case HCI_EVENT_COMMAND_STATUS:
+        {
+            HCI_COMMAND_STATUS* event = (HCI_COMMAND_STATUS*)response;
+            DebugLog("[%04x:%04x]: Event COMMAND STATUS (opcode 0x%04x, status: 0x%02x, credits: %d).\n",
+                     mVendorId, mProductId, event->opcode, event->status, event->numCommands);
+            // like Command Complete, tells how many commands the controller accepts now
+            mCommandCredits = event->numCommands;
+            if (mDeviceState == kInstructionWrite && mCommandsInFlight < mCommandCredits)
+                mDeviceState = kInstructionWritten;
+            break;
+        }
         case HCI_EVENT_NUM_COMPLETED_PACKETS:
             DebugLog("[%04x:%04x]: Number of completed packets.\n", mVendorId, mProductId);
             break;
@@ -1203,9 +1572,12 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
             break;
         case HCI_EVENT_VENDOR:
             DebugLog("[%04x:%04x]: Vendor specific event.\n", mVendorId, mProductId);
-            if (mSupportsHandshake) {
+            if (mSupportsHandshake || (mDetectHandshake && mDeviceState == kFirmwareWritten)) {
                 // Device is ready for reset.
                 mDeviceState = kResetWrite;
+            } else {
+                // a device known not to handshake, re-running the current state would reset it twice
+                mIgnoredEvent = true;
             }
             break;
         default:
@@ -1248,18 +1620,405 @@ IOReturn BrcmPatchRAM::bulkWrite(const void* data, UInt16 length)
     return result;
 }
 
+IOReturn BrcmPatchRAM::bulkWriteAsync(const void* data, UInt16 length)
+{
+    IOReturn result;
+    USBCOMPLETION completion;
+    
+    IOMemoryDescriptor* buffer = IOMemoryDescriptor::withAddress((void*)data, length, kIODirectionIn);
+    if (!buffer)
+    {
+        AlwaysLog("[%04x:%04x]: Unable to allocate bulk write buffer.\n", mVendorId, mProductId);
+        return kIOReturnNoMemory;
+    }
+    if ((result = buffer->prepare()) != kIOReturnSuccess)
+    {
+        AlwaysLog("[%04x:%04x]: Failed to prepare bulk write memory buffer (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+        buffer->release();
+        return result;
+    }
+
+    // the buffer is completed and released by writeCompletion
+#ifndef TARGET_ELCAPITAN
+    completion.target = this;
+#else
+    completion.owner = this;
+#endif
+    completion.action = writeCompletion;
+    completion.parameter = buffer;
+    // released by writeCompletion, which may come after the upload gave up on the write
+    retain();
+    OSIncrementAtomic(&mWritesPending);
+    if ((result = mBulkPipe.write(buffer, 0, 0, buffer->getLength(), &completion)) != kIOReturnSuccess)
+    {
+        AlwaysLog("[%04x:%04x]: Failed to write to bulk pipe (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+        OSDecrementAtomic(&mWritesPending);
+        buffer->complete();
+        buffer->release();
+        release();
+        return result;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+#ifndef TARGET_ELCAPITAN
+void BrcmPatchRAM::writeCompletion(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining)
+#else
+void BrcmPatchRAM::writeCompletion(void* target, void* parameter, IOReturn status, uint32_t bytesTransferred)
+#endif
+{
+    BrcmPatchRAM *me = (BrcmPatchRAM*)target;
+    IOMemoryDescriptor* buffer = (IOMemoryDescriptor*)parameter;
+    UInt32 signals = 0;
+
+    buffer->complete();
+    buffer->release();
+
+    // like readCompletion, leave the state machine to the upload thread
+    if (status != kIOReturnSuccess)
+    {
+        AlwaysLog("[%04x:%04x]: writeCompletion - Failed to write to bulk pipe (\"%s\" 0x%08x).\n", me->mVendorId, me->mProductId, me->stringFromReturn(status), status);
+        signals = kEventsWriteError;
+    }
+
+    // performUpgrade waits for failures and, once done, for the last write
+    if (OSDecrementAtomic(&me->mWritesPending) == 1 && me->mReapingWrites)
+        signals |= kEventsWakeup;
+
+    me->signalEvents(signals, status);
+    me->release();
+}
+
+bool BrcmPatchRAM::writeInstructions()
+{
+    const UInt8* instruction;
+    UInt16 length;
+
+    // Keep as many instructions in flight as both the window and the controller allow
+    // With no credits left, wait for a Command Complete or Command Status that returns some
+    while (!mInstructionsDone && mCommandsInFlight < mCommandWindow && mCommandsInFlight < mCommandCredits)
+    {
+        if (!mInstructions.getNextInstruction(instruction, length))
+        {
+            mInstructionsDone = true;
+            break;
+        }
+        recordSent(length);
+        if ((mAsyncUpload ? bulkWriteAsync(instruction, length) : bulkWrite(instruction, length)) != kIOReturnSuccess)
+            return false;
+        mCommandsInFlight++;
+        mInstructionsSent++;
+    }
+    return true;
+}
+
+bool BrcmPatchRAM::canResumeInstructions()
+{
+    // Only records are resent from the checkpoint, and only as often as commands are retried
+    if (mDeviceState != kInstructionWrite && mDeviceState != kInstructionWritten && mDeviceState != kInstructionResume)
+        return false;
+    if (mDeviceState == kInstructionWrite && mInstructionsDone && mCommandsInFlight == 0)
+        return false;
+    return mResumes < mResponseRetries;
+}
+
+bool BrcmPatchRAM::resumeInstructions()
+{
+    if (!canResumeInstructions())
+        return false;
+
+    mResumes++;
+    mStatistics.resumes++;
+    AlwaysLog("[%04x:%04x]: Resending firmware records from the last checkpoint (%u/%u).\n", mVendorId, mProductId, mResumes, mResponseRetries);
+
+    // performUpgrade sends a new barrier, the reply to an older one no longer counts
+    mResumeBarrier = false;
+    mDeviceState = kInstructionResume;
+    return true;
+}
+
+void BrcmPatchRAM::waitForController(UInt32 maxDelay, const char* phase)
+{
+    uint64_t start, now, deadline, nextPoll, wakeup, nano_secs;
+    UInt32 interval = kReadinessPollInterval;
+    IOReturn result;
+
+    if (!mAdaptiveDelays)
+    {
+        IOSleep(maxDelay);
+        return;
+    }
+
+    // Poll with HCI_LOCAL_VERSION, backing off exponentially, until the first successful
+    // Command Complete or until maxDelay expires. Only one poll is left with the controller
+    // at a time, so a dropped poll degrades to the fixed delay instead of piling up replies.
+    clock_get_uptime(&start);
+    nanoseconds_to_absolutetime((uint64_t)maxDelay * 1000000ULL, &deadline);
+    deadline += start;
+    nextPoll = now = start;
+    mControllerReady = false;
+    mReadinessPolling = true;
+    // a poll dropped in an earlier phase must not keep this phase from polling
+    mReadinessPolls = 0;
+
+    while (!mControllerReady && now < deadline && mDeviceState != kUpdateAborted)
+    {
+        if (mReadinessPolls == 0 && now >= nextPoll)
+        {
+            // counted before it is sent, the reply may be parsed while the lock is dropped
+            mReadinessPolls++;
+            // a synchronous request, don't keep the completions waiting meanwhile
+            IOLockUnlock(mCompletionLock);
+            result = mInterface.hciCommand(&HCI_LOCAL_VERSION, sizeof(HCI_LOCAL_VERSION));
+            IOLockLock(mCompletionLock);
+            if (result != kIOReturnSuccess && mReadinessPolls > 0)
+                mReadinessPolls--;
+            clock_interval_to_deadline(interval, kMillisecondScale, &nextPoll);
+            if (interval < kReadinessPollMaxInterval)
+                interval *= 2;
+        }
+        if (mReadinessPolls > 0 && !continuousRead())
+            break;
+
+        wakeup = mReadinessPolls > 0 || nextPoll > deadline ? deadline : nextPoll;
+        waitForEvents(wakeup);
+        clock_get_uptime(&now);
+    }
+
+    mReadinessPolling = false;
+    if (!mControllerReady && now < deadline && mDeviceState != kUpdateAborted)
+    {
+        // could not poll the controller, sleep whatever is left of the fixed delay
+        absolutetime_to_nanoseconds(deadline - now, &nano_secs);
+        IOLockUnlock(mCompletionLock);
+        IOSleep((UInt32)(nano_secs / 1000000));
+        IOLockLock(mCompletionLock);
+        clock_get_uptime(&now);
+    }
+
+    absolutetime_to_nanoseconds(now - start, &nano_secs);
+    DebugLog("[%04x:%04x]: %s %s after %llu ms.\n", mVendorId, mProductId, phase, mControllerReady ? "ready" : "expired", nano_secs / 1000000);
+    publishReadiness(phase, mControllerReady ? (UInt32)(nano_secs / 1000000) : maxDelay);
+}
+
+void BrcmPatchRAM::publishReadiness(const char* phase, UInt32 milliseconds)
+{
+    IOService* device = mDevice.getValidatedDevice();
+    OSDictionary* times;
+
+    if (!device)
+        return;
+
+    // replace rather than modify the published dictionary, it may be serialized concurrently
+    if (OSDictionary* published = OSDynamicCast(OSDictionary, device->getProperty(kReadinessTimes)))
+        times = OSDictionary::withDictionary(published);
+    else
+        times = OSDictionary::withCapacity(4);
+    if (!times)
+        return;
+
+    if (OSNumber* number = OSNumber::withNumber(milliseconds, 32))
+    {
+        times->setObject(phase, number);
+        number->release();
+    }
+    device->setProperty(kReadinessTimes, times);
+    times->release();
+}
+
+bool BrcmPatchRAM::waitForHandshake(UInt32 maxDelay)
+{
+    uint64_t now, deadline;
+
+    // Wait for the vendor event, the state machine moves on to kResetWrite when it arrives
+    clock_interval_to_deadline(maxDelay, kMillisecondScale, &deadline);
+    clock_get_uptime(&now);
+    while (mDeviceState == kFirmwareWritten && now < deadline)
+    {
+        if (!continuousRead())
+            break;
+        waitForEvents(deadline);
+        clock_get_uptime(&now);
+    }
+
+    if (mDeviceState != kFirmwareWritten && mDeviceState != kResetWrite)
+        return true;
+
+    // remember the outcome for later uploads to this device
+    mDetectHandshake = false;
+    mSupportsHandshake = mDeviceState == kResetWrite;
+    mDevice.setProperty(kHandshakeSupported, mSupportsHandshake);
+    AlwaysLog("[%04x:%04x]: Device %s handshake.\n", mVendorId, mProductId, mSupportsHandshake ? "supports" : "doesn't support");
+
+    return mSupportsHandshake;
+}
+
+void BrcmPatchRAM::recordSent(UInt16 length)
+{
+    mStatistics.records++;
+    mStatistics.bytes += length;
+
+    // replies are matched to records in order, give up on round trips rather than mismatch them
+    if (mStatistics.recordsSent - mStatistics.recordsAnswered >= kRoundTripTracked)
+        mStatistics.roundTripsLost = true;
+    if (mStatistics.roundTripsLost)
+        return;
+    clock_get_uptime(&mStatistics.recordSent[mStatistics.recordsSent++ % kRoundTripTracked]);
+}
+
+void BrcmPatchRAM::recordRoundTrip()
+{
+    uint64_t now, nano_secs;
+    UInt32 bucket;
+
+    if (mStatistics.roundTripsLost || mStatistics.recordsAnswered == mStatistics.recordsSent)
+        return;
+
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - mStatistics.recordSent[mStatistics.recordsAnswered++ % kRoundTripTracked], &nano_secs);
+    for (bucket = 0; bucket < kRoundTripBuckets - 1 && nano_secs >= (64000ULL << bucket); bucket++);
+    mStatistics.roundTrips[bucket]++;
+}
+
+static void setStatistic(OSDictionary* dictionary, const char* key, UInt64 value)
+{
+    if (OSNumber* number = OSNumber::withNumber(value, 64))
+    {
+        dictionary->setObject(key, number);
+        number->release();
+    }
+}
+
+void BrcmPatchRAM::publishStatistics()
+{
+    OSDictionary* statistics = OSDictionary::withCapacity(8);
+    OSDictionary* states = OSDictionary::withCapacity(kUpdateAborted + 1);
+    OSDictionary* roundTrips = OSDictionary::withCapacity(kRoundTripBuckets);
+    OSString* result = OSString::withCString(getState(mDeviceState));
+    uint64_t now, nano_secs;
+    char key[16];
+
+    if (statistics && states && roundTrips && result)
+    {
+        // Entry into each state in us since the upload started
+        for (int state = kPreInitialize; state <= kUpdateAborted; state++)
+        {
+            if (!mStatistics.stateEntered[state])
+                continue;
+            absolutetime_to_nanoseconds(mStatistics.stateEntered[state] - mStatistics.start, &nano_secs);
+            setStatistic(states, getState((DeviceState)state), nano_secs / 1000);
+        }
+
+        for (UInt32 bucket = 0; bucket < kRoundTripBuckets; bucket++)
+        {
+            if (bucket < kRoundTripBuckets - 1)
+                snprintf(key, sizeof(key), "<%lluus", 64ULL << bucket);
+            else
+                snprintf(key, sizeof(key), ">=%lluus", 64ULL << (bucket - 1));
+            setStatistic(roundTrips, key, mStatistics.roundTrips[bucket]);
+        }
+
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now - mStatistics.start, &nano_secs);
+        statistics->setObject("Result", result);
+        setStatistic(statistics, "UploadTime", nano_secs / 1000);
+        statistics->setObject("States", states);
+        setStatistic(statistics, "Records", mStatistics.records);
+        setStatistic(statistics, "Bytes", mStatistics.bytes);
+        setStatistic(statistics, "Retries", mStatistics.retries);
+        setStatistic(statistics, "Resumes", mStatistics.resumes);
+        if (!mStatistics.roundTripsLost)
+            statistics->setObject("RecordRoundTrips", roundTrips);
+
+        setProperty(kUploadStatistics, statistics);
+#ifdef NON_RESIDENT
+        // this instance is discarded once probe returns, keep a copy with the device
+        if (IOService* device = mDevice.getValidatedDevice())
+            device->setProperty(kUploadStatistics, statistics);
+#endif
+    }
+
+    OSSafeReleaseNULL(result);
+    OSSafeReleaseNULL(roundTrips);
+    OSSafeReleaseNULL(states);
+    OSSafeReleaseNULL(statistics);
+}
+
+void BrcmPatchRAM::reapReads()
+{
+    uint64_t deadline;
+
+    // readCompletion may requeue a read after the abort, repeat it if needed
+    mReapingReads = true;
+    while (mReadsQueued)
+    {
+        IOLockUnlock(mCompletionLock);
+        mInterruptPipe.abort();
+        IOLockLock(mCompletionLock);
+        clock_interval_to_deadline(mResponseTimeout, kMillisecondScale, &deadline);
+        while (mReadsQueued)
+            if (waitForEvents(deadline) == THREAD_TIMED_OUT)
+                break;
+    }
+    mReapingReads = false;
+}
+
+bool BrcmPatchRAM::reapWrites(bool abort)
+{
+    uint64_t deadline;
+
+    // a write still stuck after the response timeout is aborted, and then given up on
+    mReapingWrites = true;
+    for (int attempt = 0; mWritesPending && attempt < 2; attempt++)
+    {
+        if (abort || attempt > 0)
+        {
+            IOLockUnlock(mCompletionLock);
+            mBulkPipe.abort();
+            IOLockLock(mCompletionLock);
+        }
+        clock_interval_to_deadline(mResponseTimeout, kMillisecondScale, &deadline);
+        while (mWritesPending)
+            if (waitForEvents(deadline) == THREAD_TIMED_OUT)
+                break;
+    }
+    mReapingWrites = false;
+
+    if (mWritesPending)
+        AlwaysLog("[%04x:%04x]: %d firmware records still being written after %u ms, aborting.\n", mVendorId, mProductId, mWritesPending, mResponseTimeout);
+    return mWritesPending == 0;
+}
+
 bool BrcmPatchRAM::performUpgrade()
 {
-    BrcmFirmwareStore* firmwareStore;
-    OSArray* instructions = NULL;
-    OSCollectionIterator* iterator = NULL;
-    OSData* data;
+    OSData* instructions = NULL;
+    uint64_t uploadDeadline, responseDeadline;
+    DeviceState retryState = kUnknown;
+    UInt32 retries = 0;
+    UInt32 acknowledged;
 #ifdef DEBUG
     DeviceState previousState = kUnknown;
 #endif
 
     IOLockLock(mCompletionLock);
     mDeviceState = kPreInitialize;
+    mCommandCredits = 1;
+    mCommandsInFlight = 0;
+    mRecordsAcknowledged = 0;
+    mInstructionsSent = mInstructionsCheckpoint = 0;
+    mResumes = 0;
+    mResumeBarrier = false;
+    mInstructions.reset(NULL);
+    mInstructionsDone = false;
+    mEventRing.head = mEventRing.tail = 0;
+    IOLockLock(mEventLock);
+    mEventSignals = 0;
+    mReadStatus = mWriteStatus = kIOReturnSuccess;
+    IOLockUnlock(mEventLock);
+    bzero(&mStatistics, sizeof(mStatistics));
+    clock_get_uptime(&mStatistics.start);
+    clock_interval_to_deadline(mUploadTimeout, kMillisecondScale, &uploadDeadline);
 
     while (true)
     {
@@ -1268,11 +2027,27 @@ bool BrcmPatchRAM::performUpgrade()
             DebugLog("[%04x:%04x]: State \"%s\" --> \"%s\".\n", mVendorId, mProductId, getState(previousState), getState(mDeviceState));
         previousState = mDeviceState;
 #endif
+        if (!mStatistics.stateEntered[mDeviceState])
+            clock_get_uptime(&mStatistics.stateEntered[mDeviceState]);
 
         // Break out when done
         if (mDeviceState == kUpdateAborted || mDeviceState == kUpdateComplete || mDeviceState == kUpdateNotNeeded)
             break;
 
+        // A wedged device must not hold up the boot (and other uploads) for longer than the budget
+        clock_get_uptime(&responseDeadline);
+        if (responseDeadline >= uploadDeadline)
+        {
+            AlwaysLog("[%04x:%04x]: Firmware upload timed out after %u ms, aborting.\n", mVendorId, mProductId, mUploadTimeout);
+            mDeviceState = kUpdateAborted;
+            break;
+        }
+        if (mDeviceState != retryState)
+        {
+            retryState = mDeviceState;
+            retries = 0;
+        }
+
         // Note on following switch/case:
         //   use 'break' when a response from io completion callback is expected
         //   use 'continue' when a change of state with no expected response (loop again)
@@ -1284,18 +2059,34 @@ bool BrcmPatchRAM::performUpgrade()
                 break;
 
             case kInitialize:
-                IOSleep(mPostResetDelay);
+                waitForController(mPostResetDelay, "PostResetDelay");
                 hciCommand(&HCI_VSC_READ_VERBOSE_CONFIG, sizeof(HCI_VSC_READ_VERBOSE_CONFIG));
                 break;
 
             case kFirmwareVersion:
                 // Unable to retrieve firmware store
-                if (!(firmwareStore = getFirmwareStore()))
+                if (!getFirmwareStore())
                 {
                     mDeviceState = kUpdateAborted;
                     continue;
                 }
-                instructions = firmwareStore->getFirmware(mVendorId, mProductId, OSDynamicCast(OSString, getProperty(kFirmwareKey)));
+
+                // Decode firmware not fetched in probe while the controller loads the minidriver
+                if (mFirmwarePrefetch == kFirmwarePrefetchNone)
+                    prefetchFirmware(kFirmwarePrefetchBackground);
+
+                // Initiate firmware upgrade
+                hciCommand(&HCI_VSC_DOWNLOAD_MINIDRIVER, sizeof(HCI_VSC_DOWNLOAD_MINIDRIVER));
+                break;
+
+            case kMiniDriverComplete:
+                // If this IOSleep is not issued, the device is not ready to receive
+                // the firmware instructions and we will deadlock due to lack of
+                // responses.
+                waitForController(mInitialDelay, "InitialDelay");
+
+                // Waits for the firmware if it is still being decoded
+                instructions = mFirmwareStore->getFirmware(mVendorId, mProductId, OSDynamicCast(OSString, getProperty(kFirmwareKey)), mCoalesceRecords);
                 // Unable to retrieve firmware instructions
                 if (!instructions)
                 {
@@ -1303,43 +2094,39 @@ bool BrcmPatchRAM::performUpgrade()
                     continue;
                 }
 
-                // Initiate firmware upgrade
-                hciCommand(&HCI_VSC_DOWNLOAD_MINIDRIVER, sizeof(HCI_VSC_DOWNLOAD_MINIDRIVER));
-                break;
-
-            case kMiniDriverComplete:
                 // Should never happen, but semantically causes a leak.
-                OSSafeReleaseNULL(iterator);
                 // Write firmware data to bulk pipe
-                iterator = OSCollectionIterator::withCollection(instructions);
-                if (!iterator)
+                mInstructions.reset(instructions);
+                if (!mInstructions.isValid())
                 {
                     mDeviceState = kUpdateAborted;
                     continue;
                 }
 
-                // If this IOSleep is not issued, the device is not ready to receive
-                // the firmware instructions and we will deadlock due to lack of
-                // responses.
-                IOSleep(mInitialDelay);
-
-                // Write first instruction to trigger response
-                if ((data = OSDynamicCast(OSData, iterator->getNextObject())))
-                    bulkWrite(data->getBytesNoCopy(), data->getLength());
-                break;
+                // Write first instruction(s) to trigger response
+                mInstructionsDone = false;
+                mCommandsInFlight = 0;
+                mDeviceState = kInstructionWrite;
+                continue;
 
             case kInstructionWrite:
                 // should never happen, but would cause a crash
-                if (!iterator)
+                if (!mInstructions.isValid())
                 {
                     mDeviceState = kUpdateAborted;
                     continue;
                 }
 
-                if ((data = OSDynamicCast(OSData, iterator->getNextObject())))
-                    bulkWrite(data->getBytesNoCopy(), data->getLength());
-                else
-                    // Firmware data fully written
+                // With mAsyncUpload readCompletion continues from here until all are acknowledged
+                if (!writeInstructions())
+                {
+                    if (!resumeInstructions())
+                        mDeviceState = kUpdateAborted;
+                    continue;
+                }
+
+                // Firmware data fully written and acknowledged
+                if (mInstructionsDone && mCommandsInFlight == 0)
                     hciCommand(&HCI_VSC_END_OF_RECORD, sizeof(HCI_VSC_END_OF_RECORD));
                 break;
 
@@ -1347,9 +2134,45 @@ bool BrcmPatchRAM::performUpgrade()
                 mDeviceState = kInstructionWrite;
                 continue;
 
+            case kInstructionResume:
+                // the barrier is out, its reply rewinds the instructions
+                if (mResumeBarrier)
+                    break;
+
+                // Records still being written must reach the controller ahead of the barrier,
+                // a stuck one is aborted and counts as lost
+                if (mWritesPending && !reapWrites(true))
+                {
+                    mDeviceState = kUpdateAborted;
+                    continue;
+                }
+                reapReads();
+                mInterruptPipe.clearStall();
+                mBulkPipe.clearStall();
+
+                // HCI events arrive in order, once this is answered no other reply is on its way.
+                // Not HCI_LOCAL_VERSION, a late readiness poll reply must not pass for the barrier.
+                mResumeBarrier = true;
+                if (hciCommand(&HCI_READ_LOCAL_COMMANDS, sizeof(HCI_READ_LOCAL_COMMANDS)) != kIOReturnSuccess)
+                {
+                    mResumeBarrier = false;
+                    if (!resumeInstructions())
+                        mDeviceState = kUpdateAborted;
+                    continue;
+                }
+                break;
+
             case kFirmwareWritten:
-                if (!mSupportsHandshake) {
-                    IOSleep(mPreResetDelay);
+                if (mDetectHandshake)
+                {
+                    // the detection already waited the whole pre-reset delay if it fails
+                    if (waitForHandshake(mPreResetDelay))
+                        continue;
+                    hciCommand(&HCI_RESET, sizeof(HCI_RESET));
+                }
+                else if (!mSupportsHandshake)
+                {
+                    waitForController(mPreResetDelay, "PreResetDelay");
                     hciCommand(&HCI_RESET, sizeof(HCI_RESET));
                 }
                 break;
@@ -1359,7 +2182,7 @@ bool BrcmPatchRAM::performUpgrade()
                 break;
 
             case kResetComplete:
-                IOSleep(mPostResetDelay);
+                waitForController(mPostResetDelay, "UpgradeResetDelay");
                 getDeviceStatus();
                 mDeviceState = kUpdateComplete;
                 continue;
@@ -1372,18 +2195,58 @@ bool BrcmPatchRAM::performUpgrade()
                 break;
         }
 
-        // queue async read
+        // keep the async reads queued, an unanswered readiness poll may still own one
         if (!continuousRead())
         {
             mDeviceState = kUpdateAborted;
             continue;
         }
-        // wait for completion of the async read
-        IOLockSleep(mCompletionLock, this, 0);
+        // wait for completion of the async read, but not forever
+        clock_interval_to_deadline(mResponseTimeout, kMillisecondScale, &responseDeadline);
+        if (responseDeadline > uploadDeadline)
+            responseDeadline = uploadDeadline;
+        // records acknowledged by the completion handler in the meantime count as responses
+        acknowledged = mRecordsAcknowledged;
+        if (waitForEvents(responseDeadline) == THREAD_TIMED_OUT &&
+            mDeviceState == retryState && mRecordsAcknowledged == acknowledged)
+        {
+            // Only states whose command can safely be sent again are retried, records in flight are not
+            bool retryable = mDeviceState == kPreInitialize || mDeviceState == kInitialize || mDeviceState == kFirmwareVersion ||
+                             mDeviceState == kFirmwareWritten || mDeviceState == kResetWrite ||
+                             (mDeviceState == kInstructionWrite && mInstructionsDone && mCommandsInFlight == 0);
+            if (!retryable || retries >= mResponseRetries)
+            {
+                // unanswered records are resent from the checkpoint instead
+                AlwaysLog("[%04x:%04x]: No response from device after %u ms%s.\n", mVendorId, mProductId, mResponseTimeout, canResumeInstructions() ? "" : ", aborting");
+                if (!resumeInstructions())
+                    mDeviceState = kUpdateAborted;
+                continue;
+            }
+            retries++;
+            mStatistics.retries++;
+            // the handshake event never came, reset the device the way devices without handshake are
+            if (mDeviceState == kFirmwareWritten && mSupportsHandshake)
+                mDeviceState = kResetWrite;
+            AlwaysLog("[%04x:%04x]: No response from device after %u ms, retrying (%u/%u).\n", mVendorId, mProductId, mResponseTimeout, retries, mResponseRetries);
+        }
     }
 
+    // reap the reads left queued (readiness poll or timed out command)
+    reapReads();
+    // reap records still being written by the completion driven upload
+    if (mWritesPending)
+    {
+        DeviceState deviceState = mDeviceState;
+        if (!reapWrites(mDeviceState == kUpdateAborted))
+            deviceState = kUpdateAborted;
+        mDeviceState = deviceState;
+    }
+    mInstructions.reset(NULL);
+    mReadinessPolls = 0;
+
     IOLockUnlock(mCompletionLock);
-    OSSafeReleaseNULL(iterator);
+
+    publishStatistics();
 
     return mDeviceState == kUpdateComplete || mDeviceState == kUpdateNotNeeded;
 }
@@ -1399,7 +2262,6 @@ bool BrcmPatchRAM::supportsHandshake(UInt16 vid, UInt16 did)
     return false;
 }
 
-#ifdef DEBUG
 const char* BrcmPatchRAM::getState(DeviceState deviceState)
 {
     static const IONamedValue state_values[] = {
@@ -1410,17 +2272,18 @@ const char* BrcmPatchRAM::getState(DeviceState deviceState)
         {kMiniDriverComplete, "Mini-driver complete" },
         {kInstructionWrite,   "Instruction write"    },
         {kInstructionWritten, "Instruction written"  },
+        {kInstructionResume,  "Instruction resume"   },
         {kFirmwareWritten,    "Firmware written"     },
         {kResetWrite,         "Perform reset"        },
         {kResetComplete,      "Reset complete"       },
         {kUpdateComplete,     "Update complete"      },
         {kUpdateNotNeeded,    "Update not needed"    },
+        {kUpdateAborted,      "Update aborted"       },
         {0,                   NULL                   }
     };
     
     return IOFindNameForValue(deviceState, state_values);
 }
-#endif //DEBUG
 
 #ifndef kIOUSBClearPipeStallNotRecursive
 // from 10.7 SDK
@@ -39,6 +39,24 @@
 #define kAppleBundlePrefix "com.apple."
 #define kFirmwareKey "FirmwareKey"
 #define kFirmwareLoaded "FirmwareLoaded"
+#define kReadinessTimes "ReadinessTimes"
+#define kHandshakeSupported "HandshakeSupported"
+#define kUploadStatistics "UploadStatistics"
+
+// Backoff between HCI_LOCAL_VERSION readiness polls in ms
+#define kReadinessPollInterval 1
+#define kReadinessPollMaxInterval 32
+
+// LAUNCH_RAM round trip histogram, bucket i counts replies faster than (64 << i) us, the last one all slower
+#define kRoundTripBuckets 12
+#define kRoundTripTracked 64
+
+// Interrupt pipe reads kept queued during an upload, and events handed from their completions to the parser.
+// The ring holds the replies to a full command window while the upload thread is busy sending.
+#define kReadBufferCount 4
+#define kReadBufferSize 0x200
+#define kEventRingSize 128
+#define kEventMaxSize (2 + 255)
 
 enum DeviceState
 {
@@ -49,6 +67,7 @@ enum DeviceState
     kMiniDriverComplete,
     kInstructionWrite,
     kInstructionWritten,
+    kInstructionResume,
     kFirmwareWritten,
     kResetWrite,
     kResetComplete,
@@ -57,6 +76,52 @@ enum DeviceState
     kUpdateAborted,
 };
 
+enum FirmwarePrefetch
+{
+    kFirmwarePrefetchNone,          // decode firmware only once the controller asks for it
+    kFirmwarePrefetchProbe,         // decode firmware synchronously in probe (default)
+    kFirmwarePrefetchBackground,    // decode firmware on a worker thread started from probe
+};
+
+typedef struct UploadStatistics
+{
+    uint64_t start;
+    uint64_t stateEntered[kUpdateAborted + 1];
+    UInt32 records;
+    UInt32 bytes;
+    UInt32 retries;
+    UInt32 resumes;
+    UInt32 roundTrips[kRoundTripBuckets];
+    // send times of the records in flight, answered in order
+    uint64_t recordSent[kRoundTripTracked];
+    UInt32 recordsSent;
+    UInt32 recordsAnswered;
+    bool roundTripsLost;
+} UploadStatistics;
+
+typedef struct HciEvent
+{
+    UInt16 length;
+    UInt8 data[kEventMaxSize];
+} HciEvent;
+
+// Filled by readCompletion only, drained only with mCompletionLock held
+typedef struct EventRing
+{
+    HciEvent events[kEventRingSize];
+    volatile UInt32 head;
+    volatile UInt32 tail;
+} EventRing;
+
+// What the USB completions signal to the upload thread through mEventLock
+enum EventSignal
+{
+    kEventsPushed = 0x01,       // events to parse are in the ring
+    kEventsWakeup = 0x02,       // the state machine has to look again
+    kEventsReadError = 0x04,    // mReadStatus is set
+    kEventsWriteError = 0x08,   // mWriteStatus is set
+};
+
 typedef struct DeviceHskSupport
 {
     UInt16 vid;
@@ -95,33 +160,70 @@ private:
     UInt32 mPreResetDelay = 0;
     UInt32 mPostResetDelay = 0;
     UInt32 mInitialDelay = 0;
+    UInt32 mCommandWindow = 1;
+    bool mCoalesceRecords = false;
+    UInt32 mFirmwarePrefetch = kFirmwarePrefetchProbe;
+    bool mAdaptiveDelays = false;
+    UInt32 mResponseTimeout = 1000;
+    UInt32 mResponseRetries = 2;
+    UInt32 mUploadTimeout = 10000;
+    bool mAsyncUpload = false;
 
     USBDeviceShim mDevice;
     USBInterfaceShim mInterface;
     USBPipeShim mInterruptPipe;
     USBPipeShim mBulkPipe;
     BrcmFirmwareStore* mFirmwareStore = NULL;
-#ifndef NON_RESIDENT
+#if defined(TARGET_CATALINA) || (!defined(NON_RESIDENT))
     bool mStopping = false;
 #endif
     bool mSupportsHandshake = false;
+    bool mDetectHandshake = false;
 
-    USBCOMPLETION mInterruptCompletion {};
-    IOBufferMemoryDescriptor* mReadBuffer = NULL;
+    USBCOMPLETION mReadCompletions[kReadBufferCount] {};
+    IOBufferMemoryDescriptor* mReadBuffers[kReadBufferCount] {};
+    EventRing mEventRing {};
     
     volatile DeviceState mDeviceState = kInitialize;
     volatile uint16_t mFirmwareVersion = 0xFFFF;
+    volatile uint8_t mCommandCredits = 1;
+    UInt32 mCommandsInFlight = 0;
+    UInt32 mRecordsAcknowledged = 0;
+    UInt32 mInstructionsSent = 0;
+    UInt32 mInstructionsCheckpoint = 0;
+    UInt32 mResumes = 0;
+    bool mResumeBarrier = false;
+    BrcmPatchStreamIterator mInstructions;
+    bool mInstructionsDone = false;
+    volatile SInt32 mWritesPending = 0;
+    bool mReapingWrites = false;
+    bool mReapingReads = false;
+    volatile UInt32 mReadsQueued = 0;   // one bit per mReadBuffers entry on the pipe
+    bool mReadinessPolling = false;
+    bool mControllerReady = false;
+    bool mIgnoredEvent = false;
+    UInt32 mReadinessPolls = 0;
+    UploadStatistics mStatistics {};
     IOLock* mCompletionLock = NULL;
+    // Completions never take mCompletionLock, the upload thread holds it across synchronous
+    // requests that can't complete while a completion blocks the USB workloop
+    IOLock* mEventLock = NULL;
+    UInt32 mEventSignals = 0;
+    IOReturn mReadStatus = kIOReturnSuccess;
+    IOReturn mWriteStatus = kIOReturnSuccess;
     
-#ifdef DEBUG
     static const char* getState(DeviceState deviceState);
-#endif
 
 #ifndef TARGET_CATALINA
     static OSString* brcmBundleIdentifier;
     static OSString* brcmIOClass;
     static OSString* brcmProviderClass;
     static void initBrcmStrings();
+
+    // IOCatalogue personalities are shared by all instances, uploads are not
+    static IOLock* mPersonalityLock;
+    friend kern_return_t BrcmPatchRAM_Start(kmod_info_t*, void*);
+    friend kern_return_t BrcmPatchRAM_Stop(kmod_info_t*, void*);
 #endif
     
 #ifdef DEBUG
@@ -138,9 +240,7 @@ private:
 
     IOInterruptEventSource* mWorkSource = NULL;
     IOLock* mWorkLock = NULL;
-    static IOLock* mLoadFirmwareLock;
-    friend kern_return_t BrcmPatchRAM_Start(kmod_info_t*, void*);
-    friend kern_return_t BrcmPatchRAM_Stop(kmod_info_t*, void*);
+    IOLock* mUploadLock = NULL;
 
     enum WorkPending
     {
@@ -152,6 +252,13 @@ private:
     void processWorkQueue(IOInterruptEventSource*, int);
 #endif // #ifndef NON_RESIDENT
 
+#ifdef TARGET_CATALINA
+    // start() returns once the device is open, the upload runs on its own thread
+    static void uploadFirmwareThread(void* arg, wait_result_t wait);
+    bool mUploading = false;
+    bool openDevice();
+#endif
+
 #ifndef TARGET_CATALINA
     void publishPersonality();
 #endif
@@ -165,6 +272,8 @@ private:
     bool publishResourcePersonality(const char* classname);
 #endif
     BrcmFirmwareStore* getFirmwareStore();
+    void prefetchFirmware(UInt32 prefetch);
+    static void prefetchFirmwareThread(void* arg, wait_result_t wait);
     void uploadFirmware();
     
     void printDeviceInfo();
@@ -176,19 +285,46 @@ private:
     bool findPipe(USBPipeShim* pipe, uint8_t type, uint8_t direction);
     
     bool continuousRead();
+    bool queueRead(UInt32 index);
+    bool pushEvent(const void* data, UInt32 length);
+    bool processEvents();
+    void processErrors(UInt32 signals, IOReturn readStatus, IOReturn writeStatus);
+    void signalEvents(UInt32 signals, IOReturn status = kIOReturnSuccess);
+    int waitForEvents(uint64_t deadline);
 #if defined(TARGET_ELCAPITAN) || defined(TARGET_CATALINA)
     static void readCompletion(void* target, void* parameter, IOReturn status, uint32_t bytesTransferred);
+    static void writeCompletion(void* target, void* parameter, IOReturn status, uint32_t bytesTransferred);
 #else
     static void readCompletion(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining);
+    static void writeCompletion(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining);
 #endif
     
     IOReturn hciCommand(void * command, uint16_t length);
     IOReturn hciParseResponse(void* response, uint16_t length, void* output, uint8_t* outputLength);
     
     IOReturn bulkWrite(const void* data, uint16_t length);
+#ifdef TARGET_CATALINA
+    IOReturn hciCommandAsync(void* command, uint16_t length);
+#else
+    IOReturn bulkWriteAsync(const void* data, uint16_t length);
+#endif
+    bool writeInstructions();
+    bool canResumeInstructions();
+    bool resumeInstructions();
+    void reapReads();
+#ifndef TARGET_CATALINA
+    bool reapWrites(bool abort);
+#endif
     
     uint16_t getFirmwareVersion();
     
+    void waitForController(UInt32 maxDelay, const char* phase);
+    void publishReadiness(const char* phase, UInt32 milliseconds);
+    bool waitForHandshake(UInt32 maxDelay);
+    void recordSent(UInt16 length);
+    void recordRoundTrip();
+    void publishStatistics();
+    
     bool performUpgrade();
     bool supportsHandshake(UInt16 vid, UInt16 did);
 public:
@@ -201,9 +337,11 @@ public:
     
     const char* stringFromReturn(IOReturn rtn) override;
     
+#if defined(TARGET_CATALINA) || (!defined(NON_RESIDENT))
+    void free() override;
+#endif
 #ifdef TARGET_CATALINA
     bool init(OSDictionary *properties) override;
-    void free() override;
 #endif
 };
 
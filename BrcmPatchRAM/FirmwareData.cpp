@@ -23,17 +23,30 @@
 
 #include <string.h>
 
+static const size_t firmwareCount = sizeof(firmwares) / sizeof(firmwares[0]);
+
+/*
+ * Binary search the generated (strcmp sorted) table, the embedded firmware is returned without copying it
+ */
 OSData* lookupFirmware(const char* filename)
 {
-    OSData* result = NULL;
-    for (const FirmwareEntry* entry = firmwares; entry->filename != NULL; entry++)
+    size_t low = 0;
+    size_t high = firmwareCount;
+    
+    while (low < high)
     {
-        if (0 == strcmp(filename, entry->filename))
-        {
-            result = OSData::withBytes(entry->firmwareData, (unsigned int)entry->firmwareSize);
-            break;
-        }
+        size_t middle = low + (high - low) / 2;
+        const FirmwareEntry* entry = &firmwares[middle];
+        int order = strcmp(filename, entry->filename);
+        
+        if (order == 0)
+            return OSData::withBytesNoCopy((void*)entry->firmwareData, (unsigned int)entry->firmwareSize);
+        
+        if (order < 0)
+            high = middle;
+        else
+            low = middle + 1;
     }
-    return result;
+    
+    return NULL;
 }
-
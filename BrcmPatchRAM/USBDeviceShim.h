@@ -102,6 +102,9 @@ public:
     bool findPipe(USBPipeShim* shim, uint8_t type, uint8_t direction);
     
     IOReturn hciCommand(void * command, UInt16 length);
+#if defined(TARGET_ELCAPITAN) || defined(TARGET_CATALINA)
+    IOReturn hciCommand(void * command, UInt16 length, USBCOMPLETION* completion);
+#endif
 };
 
 class USBPipeShim
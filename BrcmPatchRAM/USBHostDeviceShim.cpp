@@ -363,6 +363,21 @@ IOReturn USBInterfaceShim::hciCommand(void* command, UInt16 length)
     return m_pInterface->deviceRequest(request, command, bytesTransfered, 0);
 }
 
+IOReturn USBInterfaceShim::hciCommand(void* command, UInt16 length, USBCOMPLETION* completion)
+{
+    StandardUSB::DeviceRequest request =
+    {
+        .bmRequestType = makeDeviceRequestbmRequestType(kRequestDirectionOut, kRequestTypeClass, kRequestRecipientDevice),
+        .bRequest = 0,
+        .wValue = 0,
+        .wIndex = 0,
+        .wLength = length
+    };
+    
+    // command must stay valid until the completion is called
+    return m_pInterface->deviceRequest(request, command, completion, kUSBHostStandardRequestCompletionTimeout);
+}
+
 USBPipeShim::USBPipeShim()
 {
     m_pPipe = NULL;
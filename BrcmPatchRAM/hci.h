@@ -33,6 +33,7 @@ typedef enum
     HCI_EVENT_CONN_COMPLETE = 0x03,
     HCI_EVENT_DISCONN_COMPLETE = 0x05,
     HCI_EVENT_COMMAND_COMPLETE = 0x0e,
+    HCI_EVENT_COMMAND_STATUS = 0x0f,
     HCI_EVENT_HARDWARE_ERROR = 0x10,
     HCI_EVENT_NUM_COMPLETED_PACKETS = 0x13,
     HCI_EVENT_MODE_CHANGE = 0x14,
@@ -75,6 +76,16 @@ struct __attribute__((packed)) HCI_COMMAND_COMPLETE: HCI_RESPONSE
     unsigned char status;
 };
 
+struct __attribute__((packed)) HCI_COMMAND_STATUS: HCI_RESPONSE
+{
+    unsigned char status;
+    unsigned char numCommands;
+    uint16_t opcode;
+};
+
+#define HCI_OPCODE_NOP 0x0000
+#define HCI_OPCODE_LOCAL_VERSION 0x1001
+#define HCI_OPCODE_READ_LOCAL_COMMANDS 0x1002
 #define HCI_OPCODE_RESET 0x0c03
 #define HCI_OPCODE_READ_VERBOSE_CONFIG 0xfc79
 #define HCI_OPCODE_DOWNLOAD_MINIDRIVER 0xfc2e
@@ -0,0 +1,148 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Records and bytes sent per firmware with and without CoalesceRecords, from the
+ * same statistics the store logs, and checks that the coalesced LAUNCH_RAM commands
+ * write exactly the same bytes to the same addresses in the same order. Also checks
+ * that records contiguous across a 64KB boundary are merged, the addresses are absolute.
+ *
+ * Usage: CoalesceStats <firmware>...
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#undef private
+#include "hci.h"
+
+// Every byte written by the LAUNCH_RAM commands as (address, value), other instructions as themselves
+static std::vector<std::pair<UInt32, int>> writtenBytes(OSData* instructions)
+{
+    std::vector<std::pair<UInt32, int>> written;
+    BrcmPatchStreamIterator iterator;
+    iterator.reset(instructions);
+
+    const UInt8* instruction;
+    UInt16 length;
+
+    while (iterator.getNextInstruction(instruction, length))
+    {
+        if (OSReadLittleInt16(instruction, 0) != HCI_OPCODE_LAUNCH_RAM)
+        {
+            for (UInt16 i = 0; i < length; i++)
+                written.push_back({ 0xFFFFFFFF, instruction[i] });
+            continue;
+        }
+
+        UInt32 address = OSReadLittleInt32(instruction, 3);
+
+        for (UInt16 i = 7; i < length; i++)
+            written.push_back({ address++, instruction[i] });
+    }
+
+    return written;
+}
+
+// Two 16 byte LAUNCH_RAM records either side of a 64KB boundary, coalesced into one command writing the same bytes
+static bool mergesAcrossSegments(BrcmFirmwareStore* store)
+{
+    PatchStreamBuilder builder(2 * 23, 2);
+
+    for (UInt32 address : { 0x0000fff0u, 0x00010000u })
+    {
+        UInt8 record[23] = { 0x4c, 0xfc, 20 };
+        OSWriteLittleInt32(record, 3, address);
+
+        for (int i = 7; i < (int)sizeof(record); i++)
+            record[i] = (UInt8)(address + i);
+
+        if (!builder.appendInstruction(record, sizeof(record)))
+            return false;
+    }
+
+    OSData* instructions = builder.finish();
+    OSData* coalesced = instructions ? store->coalesceFirmware(instructions) : NULL;
+    UInt32 count = 0, length;
+
+    if (coalesced)
+        firmwareStatistics(coalesced, count, length);
+
+    bool merged = coalesced && count == 1 && writtenBytes(instructions) == writtenBytes(coalesced);
+
+    OSSafeReleaseNULL(coalesced);
+    OSSafeReleaseNULL(instructions);
+    return merged;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <firmware>...\n", argv[0]);
+        return 1;
+    }
+
+    BrcmFirmwareStore* store = new BrcmFirmwareStore;
+    store->start(NULL);
+
+    UInt64 records = 0, bytes = 0, coalescedRecords = 0, coalescedBytes = 0;
+
+    if (!mergesAcrossSegments(store))
+    {
+        printf("MISMATCH records contiguous across a 64KB boundary were not merged\n");
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        OSData* firmware = readFileData(argv[i]);
+        OSData* instructions = store->parseFirmware(firmware);
+        OSData* coalesced = instructions ? store->coalesceFirmware(instructions) : NULL;
+
+        if (!coalesced || writtenBytes(instructions) != writtenBytes(coalesced))
+        {
+            printf("MISMATCH %s\n", argv[i]);
+            return 1;
+        }
+
+        UInt32 count, length;
+
+        firmwareStatistics(instructions, count, length);
+        records += count;
+        bytes += length;
+
+        firmwareStatistics(coalesced, count, length);
+        coalescedRecords += count;
+        coalescedBytes += length;
+
+        coalesced->release();
+        instructions->release();
+        firmware->release();
+    }
+
+    int firmwares = argc - 1;
+    printf("%d firmwares, coalesced commands write identical bytes\n", firmwares);
+    printf("  CoalesceRecords         records/fw     bytes/fw\n");
+    printf("  false                   %10.1f   %10.1f\n", (double)records / firmwares, (double)bytes / firmwares);
+    printf("  true                    %10.1f   %10.1f\n", (double)coalescedRecords / firmwares, (double)coalescedBytes / firmwares);
+    printf("  %.1fx fewer LAUNCH_RAM commands\n", (double)records / coalescedRecords);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Decode speed and compression ratio of the container codecs over the shipped
+ * firmwares, packed by firmware.rb --codec zlib and --codec lz4 as IntelHex and
+ * as patch stream. Decode MB/s counts uncompressed bytes produced by decodeFirmware
+ * alone, load ms is the whole parseFirmware. All four must give the instructions
+ * of the shipped .zhx.
+ *
+ * Usage: CodecBench <fixtures folder> <firmware.zhx>...
+ * REPEAT sets the loads per firmware (default 20).
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#undef private
+
+#include <libgen.h>
+
+static const char* const kFormats[] = { "zlib", "lz4", "zlib-stream", "lz4-stream" };
+static const int kFormatCount = sizeof(kFormats) / sizeof(kFormats[0]);
+
+struct CodecTotals
+{
+    long compressed = 0;
+    long uncompressed = 0;
+    double decodeMs = 0;
+    double loadMs = 0;
+};
+
+// Average milliseconds per decodeFirmware of container into raw data
+static double timeDecode(BrcmFirmwareStore* store, const BrcmFirmwareContainerHeader* container, int repeat)
+{
+    double start = harnessMilliseconds();
+
+    for (int i = 0; i < repeat; i++)
+    {
+        FirmwareParser parser(container->uncompressedSize, true);
+        if (!store->decodeFirmware(container, parser))
+            return -1;
+    }
+
+    return (harnessMilliseconds() - start) / repeat;
+}
+
+// Average milliseconds per parseFirmware of firmware
+static double timeParse(BrcmFirmwareStore* store, OSData* firmware, int repeat)
+{
+    double start = harnessMilliseconds();
+
+    for (int i = 0; i < repeat; i++)
+    {
+        OSData* instructions = store->parseFirmware(firmware);
+        OSSafeReleaseNULL(instructions);
+    }
+
+    return (harnessMilliseconds() - start) / repeat;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <fixtures folder> <firmware.zhx>...\n", argv[0]);
+        return 1;
+    }
+
+    BrcmFirmwareStore* store = new BrcmFirmwareStore;
+    store->start(NULL);
+
+    int repeat = harnessEnv("REPEAT", 20);
+    CodecTotals totals[kFormatCount];
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string name = basename(argv[i]);
+        OSData* shipped = readFileData(argv[i]);
+        OSData* expected = store->parseFirmware(shipped);
+
+        for (int format = 0; format < kFormatCount; format++)
+        {
+            OSData* firmware = readFileData((std::string(argv[1]) + "/" + kFormats[format] + "/" + name).c_str());
+            const BrcmFirmwareContainerHeader* container = getFirmwareContainer(firmware);
+            OSData* instructions = store->parseFirmware(firmware);
+            double decodeMs = container ? timeDecode(store, container, repeat) : -1;
+
+            if (!expected || !instructions || decodeMs < 0 || !instructions->isEqualTo(expected->getBytesNoCopy(), expected->getLength()))
+            {
+                printf("MISMATCH %s/%s\n", kFormats[format], name.c_str());
+                return 1;
+            }
+
+            totals[format].compressed += container->compressedSize;
+            totals[format].uncompressed += container->uncompressedSize;
+            totals[format].decodeMs += decodeMs;
+            totals[format].loadMs += timeParse(store, firmware, repeat);
+
+            instructions->release();
+            firmware->release();
+        }
+
+        OSSafeReleaseNULL(expected);
+        shipped->release();
+    }
+
+    int firmwares = argc - 2;
+    printf("%d firmwares, identical instructions from every codec\n", firmwares);
+    printf("  codec          payload B/fw    ratio   decode MB/s   load ms/fw\n");
+
+    for (int format = 0; format < kFormatCount; format++)
+    {
+        const CodecTotals& t = totals[format];
+        printf("  %-12s   %12ld   %6.2f   %11.1f   %10.3f\n", kFormats[format], t.compressed / firmwares, (double)t.uncompressed / t.compressed,
+               t.uncompressed / 1000.0 / t.decodeMs, t.loadMs / firmwares);
+    }
+    return 0;
+}
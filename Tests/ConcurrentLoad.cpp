@@ -0,0 +1,112 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Stress of getFirmware from several threads at once on a new store, each asking
+ * for a different firmware key or all for the same one. Resources come from $RESDIR
+ * after $RESDELAY ms like a slow kextd. Distinct keys should take about as long as
+ * one, the same key must be loaded once and every thread must get the same instructions.
+ *
+ * Usage: ConcurrentLoad <firmware.zhx>..., the file names are the firmware keys
+ * THREADS sets the most threads (default 8), runs double from 1 up to it.
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#undef private
+
+#include <libgen.h>
+#include <thread>
+
+struct LoadRun
+{
+    double milliseconds;
+    long requests;
+    bool failed;
+};
+
+// threads calls of getFirmware on a new store, for keys[0] only if same
+static LoadRun loadConcurrently(const std::vector<std::string>& keys, int threads, bool same)
+{
+    BrcmFirmwareStore* store = new BrcmFirmwareStore;
+    store->start(NULL);
+
+    std::vector<OSData*> results(threads);
+    std::vector<std::thread> workers;
+    long requests = gHarnessResourceRequests;
+    double start = harnessMilliseconds();
+
+    for (int i = 0; i < threads; i++)
+    {
+        workers.emplace_back([&, i]() {
+            OSString* key = OSString::withCString(keys[same ? 0 : i % keys.size()].c_str());
+            results[i] = store->getFirmware(0x0a5c, 0x21e8, key);
+            key->release();
+        });
+    }
+
+    for (std::thread& worker : workers)
+        worker.join();
+
+    LoadRun run = { harnessMilliseconds() - start, gHarnessResourceRequests - requests, false };
+
+    for (OSData* result : results)
+        run.failed |= !result || (same && result != results[0]);
+
+    store->stop(NULL);
+    store->release();
+    return run;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <firmware.zhx>...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> keys;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string name = basename(argv[i]);
+        keys.push_back(name.substr(0, name.rfind('.')));
+    }
+
+    int maxThreads = harnessEnv("THREADS", 8);
+    bool failed = false;
+
+    printf("RESDELAY=%d, %zu firmware keys\n", harnessEnv("RESDELAY", 0), keys.size());
+    printf("  threads   distinct keys ms   requests   same key ms   requests\n");
+
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        LoadRun distinct = loadConcurrently(keys, threads, false);
+        LoadRun same = loadConcurrently(keys, threads, true);
+
+        printf("  %7d   %16.1f   %8ld   %11.1f   %8ld\n", threads, distinct.milliseconds, distinct.requests, same.milliseconds, same.requests);
+        failed |= distinct.failed || same.failed;
+    }
+
+    if (failed)
+        printf("FAIL a thread got no or different instructions\n");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Round trip of every shipped header-less .zhx through the firmware container
+ * (firmware.rb --codec zlib), as IntelHex and as patch stream: all three must give
+ * identical instructions, and a container with a flipped payload byte, a truncated
+ * payload or an unknown version must be rejected. Also reports what each parse
+ * allocates, the header sizes the parse buffer exactly instead of guessing 4x.
+ *
+ * Usage: ContainerRoundTrip <fixtures folder> <firmware.zhx>...
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#undef private
+
+#include <libgen.h>
+
+struct Allocations
+{
+    long count = 0;
+    long bytes = 0;
+};
+
+// parseFirmware of firmware, adding its allocations to allocations
+static OSData* parse(BrcmFirmwareStore* store, OSData* firmware, Allocations& allocations)
+{
+    long count = gHarnessAllocations.allocations, bytes = gHarnessAllocations.bytes;
+    OSData* instructions = store->parseFirmware(firmware);
+
+    allocations.count += gHarnessAllocations.allocations - count;
+    allocations.bytes += gHarnessAllocations.bytes - bytes;
+    return instructions;
+}
+
+static bool same(OSData* a, OSData* b)
+{
+    return a && b && a->isEqualTo(b->getBytesNoCopy(), b->getLength());
+}
+
+// Must not parse, the copy of container is damaged by damage
+template <typename Damage>
+static bool rejected(BrcmFirmwareStore* store, OSData* container, Damage damage)
+{
+    std::vector<UInt8> bytes((const UInt8*)container->getBytesNoCopy(), (const UInt8*)container->getBytesNoCopy() + container->getLength());
+    damage(bytes);
+
+    OSData* damaged = OSData::withBytes(bytes.data(), (unsigned)bytes.size());
+    OSData* instructions = store->parseFirmware(damaged);
+    damaged->release();
+
+    OSSafeReleaseNULL(instructions);
+    return instructions == NULL;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <fixtures folder> <firmware.zhx>...\n", argv[0]);
+        return 1;
+    }
+
+    BrcmFirmwareStore* store = new BrcmFirmwareStore;
+    store->start(NULL);
+
+    Allocations shippedAllocations, hexAllocations, streamAllocations;
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string name = basename(argv[i]);
+        OSData* shipped = readFileData(argv[i]);
+        OSData* hex = readFileData((std::string(argv[1]) + "/zlib/" + name).c_str());
+        OSData* stream = readFileData((std::string(argv[1]) + "/zlib-stream/" + name).c_str());
+
+        OSData* shippedInstructions = parse(store, shipped, shippedAllocations);
+        OSData* hexInstructions = parse(store, hex, hexAllocations);
+        OSData* streamInstructions = parse(store, stream, streamAllocations);
+
+        if (!same(shippedInstructions, hexInstructions) || !same(shippedInstructions, streamInstructions))
+        {
+            printf("MISMATCH %s\n", argv[i]);
+            return 1;
+        }
+
+        bool corruptRejected =
+            rejected(store, hex, [](std::vector<UInt8>& bytes) { bytes.back() ^= 0x01; }) &&
+            rejected(store, hex, [](std::vector<UInt8>& bytes) { bytes.pop_back(); }) &&
+            rejected(store, hex, [](std::vector<UInt8>& bytes) { bytes[offsetof(BrcmFirmwareContainerHeader, version)]++; });
+
+        if (!corruptRejected)
+        {
+            printf("ACCEPTED CORRUPT %s\n", argv[i]);
+            return 1;
+        }
+
+        OSSafeReleaseNULL(shippedInstructions);
+        OSSafeReleaseNULL(hexInstructions);
+        OSSafeReleaseNULL(streamInstructions);
+        shipped->release();
+        hex->release();
+        stream->release();
+    }
+
+    int firmwares = argc - 2;
+    printf("%d firmwares, identical instructions with and without container, corrupt containers rejected\n", firmwares);
+    printf("  format                  allocations/fw   allocated B/fw\n");
+    printf("  header-less zlib        %14.1f   %14ld\n", (double)shippedAllocations.count / firmwares, shippedAllocations.bytes / firmwares);
+    printf("  container IntelHex      %14.1f   %14ld\n", (double)hexAllocations.count / firmwares, hexAllocations.bytes / firmwares);
+    printf("  container patch stream  %14.1f   %14ld\n", (double)streamAllocations.count / firmwares, streamAllocations.bytes / firmwares);
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Size and load time of the shipped firmwares stored as deltas against a chip
+ * family base (firmware.rb --delta) instead of independently deflated. The bases
+ * are requested from $RESDIR like in the kext, every delta must give the
+ * instructions of its shipped .zhx.
+ *
+ * Usage: DeltaBench <delta folder> <firmware.zhx>...
+ * REPEAT sets the loads per firmware (default 20).
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#undef private
+
+#include <filesystem>
+#include <libgen.h>
+
+// Average milliseconds per parseFirmware of firmware
+static double timeParse(BrcmFirmwareStore* store, OSData* firmware, int repeat)
+{
+    double start = harnessMilliseconds();
+
+    for (int i = 0; i < repeat; i++)
+    {
+        OSData* instructions = store->parseFirmware(firmware);
+        OSSafeReleaseNULL(instructions);
+    }
+
+    return (harnessMilliseconds() - start) / repeat;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <delta folder> <firmware.zhx>...\n", argv[0]);
+        return 1;
+    }
+
+    BrcmFirmwareStore* store = new BrcmFirmwareStore;
+    store->start(NULL);
+
+    int repeat = harnessEnv("REPEAT", 20);
+    double shippedTime = 0, deltaTime = 0;
+    long shippedBytes = 0, deltaBytes = 0, baseBytes = 0;
+    int deltas = 0;
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string name = basename(argv[i]);
+        OSData* shipped = readFileData(argv[i]);
+        OSData* delta = readFileData((std::string(argv[1]) + "/" + name).c_str());
+
+        OSData* shippedInstructions = store->parseFirmware(shipped);
+        OSData* deltaInstructions = store->parseFirmware(delta);
+
+        if (!shippedInstructions || !deltaInstructions || !shippedInstructions->isEqualTo(deltaInstructions->getBytesNoCopy(), deltaInstructions->getLength()))
+        {
+            printf("MISMATCH %s\n", argv[i]);
+            return 1;
+        }
+
+        const BrcmFirmwareContainerHeader* container = getFirmwareContainer(delta);
+        if (container && container->codec == kBrcmFirmwareCodecDelta)
+            deltas++;
+
+        shippedTime += timeParse(store, shipped, repeat);
+        deltaTime += timeParse(store, delta, repeat);
+        shippedBytes += shipped->getLength();
+        deltaBytes += delta->getLength();
+
+        shippedInstructions->release();
+        deltaInstructions->release();
+        shipped->release();
+        delta->release();
+    }
+
+    // The bases ship in addition to the deltas
+    for (const auto& entry : std::filesystem::directory_iterator(argv[1]))
+    {
+        if (entry.path().filename().string().find("_base.") != std::string::npos)
+            baseBytes += entry.file_size();
+    }
+
+    int firmwares = argc - 2;
+    printf("%d firmwares, %d stored as deltas, identical instructions\n", firmwares, deltas);
+    printf("  packing                 total bytes   load ms/fw\n");
+    printf("  independently deflated %12ld   %10.3f\n", shippedBytes, shippedTime / firmwares);
+    printf("  deltas + bases         %12ld   %10.3f\n", deltaBytes + baseBytes, deltaTime / firmwares);
+    printf("  %.1fx smaller, bases %ld bytes\n", (double)shippedBytes / (deltaBytes + baseBytes), baseBytes);
+    return 0;
+}
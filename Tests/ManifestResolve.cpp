@@ -0,0 +1,111 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Resource requests and wall time per device of getFirmware on one store, once
+ * against resources with a Manifest.plist and once against the same resources
+ * without. Every request is answered after $RESDELAY ms like a slow kextd.
+ *
+ * Usage: ManifestResolve <resources with manifest> <resources without> <firmware.zhx>...
+ * the file names are the firmware keys.
+ *
+ * Fails if a firmware does not load, or if the manifest does not cut both the resource
+ * requests and the wall time per device.
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#undef private
+
+#include <libgen.h>
+
+struct ResolveRun
+{
+    double milliseconds;
+    long requests;
+    bool failed;
+};
+
+// getFirmware of every key one after the other on a new store, resources from directory
+static ResolveRun resolve(const char* directory, const std::vector<std::string>& keys)
+{
+    setenv("RESDIR", directory, 1);
+
+    BrcmFirmwareStore* store = new BrcmFirmwareStore;
+    store->start(NULL);
+
+    ResolveRun run = { 0, 0, false };
+    long requests = gHarnessResourceRequests;
+    double start = harnessMilliseconds();
+
+    for (const std::string& name : keys)
+    {
+        OSString* key = OSString::withCString(name.c_str());
+        OSData* instructions = store->getFirmware(0x0a5c, 0x21e8, key);
+
+        run.failed |= !instructions;
+        key->release();
+    }
+
+    run.milliseconds = harnessMilliseconds() - start;
+    run.requests = gHarnessResourceRequests - requests;
+
+    store->stop(NULL);
+    store->release();
+    return run;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s <resources with manifest> <resources without> <firmware.zhx>...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> keys;
+    for (int i = 3; i < argc; i++)
+    {
+        std::string name = basename(argv[i]);
+        keys.push_back(name.substr(0, name.rfind('.')));
+    }
+
+    ResolveRun manifest = resolve(argv[1], keys);
+    ResolveRun plain = resolve(argv[2], keys);
+    int devices = (int)keys.size();
+
+    printf("RESDELAY=%d, %d devices\n", harnessEnv("RESDELAY", 0), devices);
+    printf("  resources               requests/device   ms/device\n");
+    printf("  with Manifest.plist     %15.2f   %9.1f\n", (double)manifest.requests / devices, manifest.milliseconds / devices);
+    printf("  without                 %15.2f   %9.1f\n", (double)plain.requests / devices, plain.milliseconds / devices);
+
+    bool failed = manifest.failed || plain.failed;
+
+    if (failed)
+        printf("FAIL a firmware did not load\n");
+
+    if (manifest.requests >= plain.requests || manifest.milliseconds >= plain.milliseconds)
+    {
+        printf("FAIL the manifest did not cut resource requests and wall time\n");
+        failed = true;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,161 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Runs several instances of the resident BrcmPatchRAM (BrcmPatchRAM.kext) at once,
+ * each on its own simulated device (sim/Controller.h) sharing one firmware store,
+ * and reports how long patching all of them took. At boot every device is probed
+ * on its own matching thread, on wake processWorkQueue starts uploadFirmwareThread
+ * for each.
+ *
+ * Usage: MultiDeviceSim, firmwares are requested from $RESDIR
+ *
+ *   DEVICES     simulated devices (default 4)
+ *   KEY         FirmwareKey of the devices (default BCM20702A1_001.002.014.1443.1447_v5543)
+ *   SERIAL      patch one device after the other, what the former static upload lock did
+ *
+ * See Controller.h for the controller settings. Fails if an upload does not complete.
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#include "BrcmPatchRAM.cpp"
+#undef private
+
+#include "sim/Shims.h"
+
+struct Instance
+{
+    SimDevice* device;
+    BrcmPatchRAM* driver;
+    double patched;
+};
+
+// Runs upload for every instance, each on a thread of its own or one after the other
+static double patchAll(std::vector<Instance>& instances, bool serial, void (*upload)(Instance& instance))
+{
+    std::vector<std::thread> threads;
+    double start = harnessMilliseconds();
+
+    for (Instance& instance : instances)
+    {
+        auto patch = [&instance, start, upload]() {
+            upload(instance);
+            instance.patched = harnessMilliseconds() - start;
+        };
+
+        if (serial)
+            patch();
+        else
+            threads.emplace_back(patch);
+    }
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    return harnessMilliseconds() - start;
+}
+
+// Boot: probe uploads the firmware before the driver is even started
+static void probeDevice(Instance& instance)
+{
+    SInt32 score = 0;
+    instance.driver->probe(instance.device, &score);
+}
+
+// Wake: what processWorkQueue does for kWorkLoadFirmware, without the workloop the runtime has not
+static void wakeDevice(Instance& instance)
+{
+    instance.driver->retain();
+    BrcmPatchRAM::uploadFirmwareThread(instance.driver, THREAD_AWAKENED);
+    instance.driver->release();
+}
+
+// Time to patch each device and whether every upload completed
+static bool printPhase(const char* phase, std::vector<Instance>& instances, double milliseconds)
+{
+    bool complete = true;
+
+    printf("  %-5s all patched in %7.1f ms, each after", phase, milliseconds);
+    for (Instance& instance : instances)
+    {
+        printf(" %.1f", instance.patched);
+        complete &= instance.driver->mDeviceState == kUpdateComplete;
+        instance.driver->mDeviceState = kUnknown;
+    }
+    printf(" ms\n");
+
+    if (!complete)
+        printf("  FAIL an upload did not complete\n");
+    return complete;
+}
+
+int main(int argc, char** argv)
+{
+    const char* key = getenv("KEY") ? getenv("KEY") : "BCM20702A1_001.002.014.1443.1447_v5543";
+    int devices = harnessEnv("DEVICES", 4);
+    bool serial = harnessEnv("SERIAL", 0) != 0;
+    std::vector<Instance> instances;
+    bool failed = false;
+
+    // BrcmPatchRAM.kext refuses to run on 10.11 and later
+    version_major = 14;
+
+    BrcmPatchRAM_Start(NULL, NULL);
+    gSimFirmwareStore = new BrcmFirmwareStore;
+    gSimFirmwareStore->start(NULL);
+
+    for (int i = 0; i < devices; i++)
+    {
+        // product ids of no device in the handshake table, a controller without the vendor event would make it wait
+        Instance instance = { new SimDevice(0x0a5c, (UInt16)(0x2300 + i)), new BrcmPatchRAM, 0 };
+
+        // what the personality in Info.plist provides
+        OSString* firmwareKey = OSString::withCString(key);
+        instance.driver->setProperty(kFirmwareKey, firmwareKey);
+        firmwareKey->release();
+
+        instance.driver->init(NULL);
+        instances.push_back(instance);
+    }
+
+    printf("DEVICES=%d%s\n", devices, serial ? " SERIAL=1" : "");
+
+    failed |= !printPhase("boot", instances, patchAll(instances, serial, probeDevice));
+
+    // start() needs a workloop, the wake only needs the source scheduleWork signals
+    for (Instance& instance : instances)
+        instance.driver->mWorkSource = IOInterruptEventSource::interruptEventSource(instance.driver, NULL);
+
+    failed |= !printPhase("wake", instances, patchAll(instances, serial, wakeDevice));
+
+    for (Instance& instance : instances)
+    {
+        instance.driver->stop(instance.device);
+        instance.driver->release();
+        instance.device->release();
+    }
+
+    gSimFirmwareStore->stop(NULL);
+    OSSafeReleaseNULL(gSimFirmwareStore);
+    BrcmPatchRAM_Stop(NULL, NULL);
+    return failed ? 1 : 0;
+}
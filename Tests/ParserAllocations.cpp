@@ -0,0 +1,122 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Counts the kernel allocations made by parseFirmware and the memory the parsed
+ * firmware keeps resident, for the single patch stream buffer the store uses and
+ * for the former OSArray of one OSData per instruction built from the same records.
+ *
+ * Usage: ParserAllocations <firmware>...
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#undef private
+#include "hci.h"
+
+// Allocations while building the OSArray-of-OSData layout the store used to keep, and what it keeps resident
+static OSArray* buildRecordArray(OSData* instructions)
+{
+    BrcmPatchStreamIterator iterator;
+    iterator.reset(instructions);
+
+    OSArray* records = OSArray::withCapacity(iterator.getCount());
+    const UInt8* instruction;
+    UInt16 length;
+
+    while (iterator.getNextInstruction(instruction, length))
+    {
+        OSData* record = OSData::withBytes(instruction, length);
+        records->setObject(record);
+        record->release();
+    }
+
+    return records;
+}
+
+static bool validInstructions(OSData* instructions, UInt32 &records)
+{
+    BrcmPatchStreamIterator iterator;
+    iterator.reset(instructions);
+
+    const UInt8* instruction;
+    UInt16 length;
+
+    records = 0;
+    while (iterator.getNextInstruction(instruction, length))
+    {
+        // LAUNCH_RAM opcode, parameter length, address and data
+        if (length < 7 || OSReadLittleInt16(instruction, 0) != HCI_OPCODE_LAUNCH_RAM || instruction[2] + 3 != length)
+            return false;
+        records++;
+    }
+
+    return iterator.isValid() && records > 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <firmware>...\n", argv[0]);
+        return 1;
+    }
+
+    BrcmFirmwareStore* store = new BrcmFirmwareStore;
+    store->start(NULL);
+
+    long records = 0, streamAllocations = 0, streamResident = 0, arrayAllocations = 0, arrayResident = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        OSData* firmware = readFileData(argv[i]);
+
+        long allocations = gHarnessAllocations.allocations, live = gHarnessAllocations.live;
+        OSData* instructions = store->parseFirmware(firmware);
+        streamAllocations += gHarnessAllocations.allocations - allocations;
+        streamResident += gHarnessAllocations.live - live;
+
+        UInt32 count;
+        if (!instructions || !validInstructions(instructions, count))
+        {
+            printf("FAIL %s\n", argv[i]);
+            return 1;
+        }
+        records += count;
+
+        allocations = gHarnessAllocations.allocations;
+        live = gHarnessAllocations.live;
+        OSArray* array = buildRecordArray(instructions);
+        arrayAllocations += gHarnessAllocations.allocations - allocations;
+        arrayResident += gHarnessAllocations.live - live;
+
+        array->release();
+        instructions->release();
+        firmware->release();
+    }
+
+    int firmwares = argc - 1;
+    printf("%d firmwares, %.0f records per firmware\n", firmwares, (double)records / firmwares);
+    printf("  layout                  allocations/fw   resident/fw\n");
+    printf("  patch stream (parsed)   %14.1f   %9ld B\n", (double)streamAllocations / firmwares, streamResident / firmwares);
+    printf("  OSArray of OSData       %14.1f   %9ld B\n", (double)arrayAllocations / firmwares, arrayResident / firmwares);
+    return 0;
+}
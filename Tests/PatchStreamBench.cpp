@@ -0,0 +1,99 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Times parseFirmware on the shipped IntelHex .zhx against the same firmware
+ * pre-compiled into a patch stream (firmware.rb --compile), and checks both
+ * load paths produce identical instructions.
+ *
+ * Usage: PatchStreamBench <patch stream folder> <firmware.zhx>...
+ * REPEAT sets the loads per firmware (default 20).
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#undef private
+
+#include <libgen.h>
+
+// Average milliseconds per parseFirmware of firmware
+static double timeParse(BrcmFirmwareStore* store, OSData* firmware, int repeat)
+{
+    double start = harnessMilliseconds();
+
+    for (int i = 0; i < repeat; i++)
+    {
+        OSData* instructions = store->parseFirmware(firmware);
+        OSSafeReleaseNULL(instructions);
+    }
+
+    return (harnessMilliseconds() - start) / repeat;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <patch stream folder> <firmware.zhx>...\n", argv[0]);
+        return 1;
+    }
+
+    BrcmFirmwareStore* store = new BrcmFirmwareStore;
+    store->start(NULL);
+
+    int repeat = harnessEnv("REPEAT", 20);
+    double hexTime = 0, streamTime = 0;
+    long hexBytes = 0, streamBytes = 0;
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string streamPath = std::string(argv[1]) + "/" + basename(argv[i]);
+        OSData* hex = readFileData(argv[i]);
+        OSData* stream = readFileData(streamPath.c_str());
+
+        OSData* hexInstructions = store->parseFirmware(hex);
+        OSData* streamInstructions = store->parseFirmware(stream);
+
+        if (!hexInstructions || !streamInstructions || !hexInstructions->isEqualTo(streamInstructions->getBytesNoCopy(), streamInstructions->getLength()))
+        {
+            printf("MISMATCH %s\n", argv[i]);
+            return 1;
+        }
+
+        hexTime += timeParse(store, hex, repeat);
+        streamTime += timeParse(store, stream, repeat);
+        hexBytes += hex->getLength();
+        streamBytes += stream->getLength();
+
+        hexInstructions->release();
+        streamInstructions->release();
+        hex->release();
+        stream->release();
+    }
+
+    int firmwares = argc - 2;
+    printf("%d firmwares, identical instructions from both formats\n", firmwares);
+    printf("  format                  .zhx bytes/fw   load ms/fw\n");
+    printf("  IntelHex                %13ld   %10.3f\n", hexBytes / firmwares, hexTime / firmwares);
+    printf("  patch stream            %13ld   %10.3f\n", streamBytes / firmwares, streamTime / firmwares);
+    printf("  speedup %.1fx\n", hexTime / streamTime);
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Peak kernel memory of loadFirmware from resources, which parses the firmware
+ * out of the buffer borrowed in the OSKextRequestResource callback, against the
+ * former path copying the resource into an OSData before parsing it. The buffer of
+ * the mock callback belongs to kextd and is not counted in either case.
+ *
+ * Usage: ResourcePeak <firmware.zhx>..., requested from $RESDIR by file name
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#undef private
+
+#include <libgen.h>
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <firmware.zhx>...\n", argv[0]);
+        return 1;
+    }
+
+    BrcmFirmwareStore* store = new BrcmFirmwareStore;
+    store->start(NULL);
+
+    long borrowedPeak = 0, copiedPeak = 0, maxBorrowedPeak = 0, maxCopiedPeak = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string name = basename(argv[i]);
+        OSString* key = OSString::withCString(name.substr(0, name.rfind('.')).c_str());
+        bool missing;
+
+        long live = gHarnessAllocations.live;
+        harnessResetPeak();
+        OSData* borrowed = store->loadFirmware(0x0a5c, 0x21e8, key, missing);
+        long borrowedBytes = gHarnessAllocations.peak - live;
+
+        // the former requestResourceCallback copied the resource, parseFirmware ran after the request
+        std::vector<UInt8> resource = readFile(argv[i]);
+
+        live = gHarnessAllocations.live;
+        harnessResetPeak();
+        OSData* copy = OSData::withBytes(resource.data(), (unsigned)resource.size());
+        OSData* copied = store->parseFirmware(copy);
+        copy->release();
+        long copiedBytes = gHarnessAllocations.peak - live;
+
+        if (!borrowed || !copied)
+        {
+            printf("FAIL %s\n", argv[i]);
+            return 1;
+        }
+
+        borrowedPeak += borrowedBytes;
+        copiedPeak += copiedBytes;
+        maxBorrowedPeak = std::max(maxBorrowedPeak, borrowedBytes);
+        maxCopiedPeak = std::max(maxCopiedPeak, copiedBytes);
+
+        borrowed->release();
+        copied->release();
+        key->release();
+    }
+
+    int firmwares = argc - 1;
+    printf("%d firmwares loaded from resources\n", firmwares);
+    printf("  resource data           peak B/fw     max peak B\n");
+    printf("  parsed in callback      %9ld   %12ld\n", borrowedPeak / firmwares, maxBorrowedPeak);
+    printf("  copied, then parsed     %9ld   %12ld\n", copiedPeak / firmwares, maxCopiedPeak);
+    printf("  %.0f%% lower peak\n", 100.0 * (copiedPeak - borrowedPeak) / copiedPeak);
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Peak kernel memory while parseFirmware inflates and parses a .zhx, against what
+ * the former decompressFirmware needed: a scratch buffer of four times the compressed
+ * size plus a copy of the inflated IntelHex, before parsing even started. Also counts
+ * the firmwares compressing better than 4:1, which did not fit that scratch buffer.
+ *
+ * Usage: StreamingPeak <firmware.zhx>...
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#undef private
+
+#include <zlib.h>
+
+static long inflatedSize(OSData* firmware)
+{
+    z_stream stream = {};
+    UInt8 buffer[16384];
+    long size = 0;
+    int result;
+
+    stream.next_in = (Bytef*)firmware->getBytesNoCopy();
+    stream.avail_in = firmware->getLength();
+    inflateInit(&stream);
+
+    do
+    {
+        stream.next_out = buffer;
+        stream.avail_out = sizeof(buffer);
+        result = inflate(&stream, Z_NO_FLUSH);
+        size += sizeof(buffer) - stream.avail_out;
+    } while (result == Z_OK);
+
+    inflateEnd(&stream);
+    return result == Z_STREAM_END ? size : -1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <firmware.zhx>...\n", argv[0]);
+        return 1;
+    }
+
+    BrcmFirmwareStore* store = new BrcmFirmwareStore;
+    store->start(NULL);
+
+    long streamingPeak = 0, formerPeak = 0, maxStreamingPeak = 0, maxFormerPeak = 0;
+    int overflows = 0;
+    double maxRatio = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        OSData* firmware = readFileData(argv[i]);
+        long compressed = firmware->getLength();
+        long inflated = inflatedSize(firmware);
+
+        long live = gHarnessAllocations.live;
+        harnessResetPeak();
+        OSData* instructions = store->parseFirmware(firmware);
+        long peak = gHarnessAllocations.peak - live;
+
+        if (!instructions || inflated < 0)
+        {
+            printf("FAIL %s\n", argv[i]);
+            return 1;
+        }
+
+        // the parsed instructions were built on top of the former buffers as well
+        long former = compressed * 4 + inflated + instructions->getCapacity();
+
+        streamingPeak += peak;
+        formerPeak += former;
+        maxStreamingPeak = std::max(maxStreamingPeak, peak);
+        maxFormerPeak = std::max(maxFormerPeak, former);
+        maxRatio = std::max(maxRatio, (double)inflated / compressed);
+
+        if (inflated > compressed * 4)
+            overflows++;
+
+        instructions->release();
+        firmware->release();
+    }
+
+    int firmwares = argc - 1;
+    printf("%d firmwares, compressed up to %.1f:1, %d of them better than 4:1\n", firmwares, maxRatio, overflows);
+    printf("  decompression           peak B/fw     max peak B\n");
+    printf("  streaming (parsed)      %9ld   %12ld\n", streamingPeak / firmwares, maxStreamingPeak);
+    printf("  former 4x scratch       %9ld   %12ld\n", formerPeak / firmwares, maxFormerPeak);
+    return 0;
+}
@@ -0,0 +1,380 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Runs BrcmPatchRAM3 through probe, start and stop against a simulated controller
+ * (sim/Controller.h) and reports how long the firmware upload took.
+ *
+ * Usage: UploadSim, firmwares are requested from $RESDIR
+ *
+ *   KEY         FirmwareKey of the device (default BCM20702A1_001.002.014.1443.1447_v5543)
+ *   WINDOW      CommandWindow (default 1)
+ *   COALESCE    CoalesceRecords (default 0)
+ *   PREFETCH    FirmwarePrefetch, 0 lazy, 1 probe, 2 background (default 1)
+ *   ADAPTIVE    AdaptiveDelays, poll for readiness instead of sleeping the delays (default 0)
+ *   ASYNC       AsyncUpload, the completion handler sends the next records (default 0),
+ *               once set the CPU time, context switches and lock sleeps of the upload are printed
+ *   HANDSHAKE   handshake support the driver learned for the device earlier, 0 or 1
+ *               (default unset, the device is not in the handshake table so it is detected)
+ *   TIMEOUT     ResponseTimeout in ms (default unset, the driver's 1000)
+ *   RETRIES     ResponseRetries (default unset, the driver's 2)
+ *   UPLOADTIMEOUT  UploadTimeout in ms (default unset, the driver's 10000)
+ *   ABORTS      the faults injected are more than the driver may recover from, the
+ *               upload has to give up instead of complete
+ *   STATISTICS  print the UploadStatistics the driver published and check them against
+ *               what the controller saw
+ *   LIFECYCLE   print how long start() took to return and whether the device stayed
+ *               open for the driver from then until the upload was done
+ *   SYNCSTART   kernel_thread_start fails, start() uploads before it returns as it
+ *               did before the upload thread
+ *   RUNS        uploads, each by a new driver instance (default 1)
+ *
+ * Every run has a new firmware store, so the firmware is loaded again, set RESDELAY
+ * to make that slow. See Controller.h for the controller settings. Fails if an
+ * upload does not complete (or with ABORTS, does), takes longer than the upload
+ * budget allows, or the driver sends a command the controller has no credit for.
+ * With LIFECYCLE, also if the device is left unopened while the upload runs or still
+ * open when the service is registered. With PATCHED (see Controller.h) and PREFETCH=0
+ * also if the store is asked for the firmware, or, with ADAPTIVE, if probe and start
+ * take longer than their HCI round trips.
+ */
+
+#include "Harness.h"
+
+#define private public
+#include "BrcmFirmwareStore.cpp"
+#include "BrcmPatchRAM3.cpp"
+#undef private
+
+#include "sim/Shims.h"
+
+#include <sys/resource.h>
+
+static std::atomic<double> gRegistered{0};
+static std::mutex gRegisteredMutex;
+static std::condition_variable gRegisteredCondition;
+static SimDevice* gDevice;
+static bool gOpenAtRegistration;
+
+static void registered(IOService* service)
+{
+    if (OSDynamicCast(BrcmPatchRAM3, service))
+    {
+        std::lock_guard<std::mutex> guard(gRegisteredMutex);
+        gOpenAtRegistration = gDevice->opened;
+        gRegistered = harnessMilliseconds();
+        gRegisteredCondition.notify_all();
+    }
+}
+
+// ms of each phase the driver published in ReadinessTimes on the device
+static void printReadiness(SimDevice* device, int polls)
+{
+    static const char* const phases[] = { "PostResetDelay", "InitialDelay", "PreResetDelay", "UpgradeResetDelay" };
+    OSDictionary* times = OSDynamicCast(OSDictionary, device->getProperty(kReadinessTimes));
+
+    if (!times)
+        return;
+
+    printf("         readiness");
+    for (const char* phase : phases)
+    {
+        if (OSNumber* time = OSDynamicCast(OSNumber, times->getObject(phase)))
+            printf(" %s %u ms,", phase, time->unsigned32BitValue());
+    }
+    printf(" %d polls\n", polls);
+}
+
+// The settings of this run taken from the environment
+static void printSettings()
+{
+    static const char* const settings[] = { "KEY", "WINDOW", "COALESCE", "PREFETCH", "ADAPTIVE", "ASYNC", "RTTUS", "SERVICEUS", "CREDITS", "ZEROCREDIT",
+                                            "READYRESET", "READYMINI", "DROPPOLLS", "VENDOR", "VENDORDELAY", "HANDSHAKE", "WORKLOOP", "DROPOP",
+                                            "DROPN", "WEDGEAFTER", "TIMEOUT", "RETRIES", "UPLOADTIMEOUT", "ABORTS", "STATISTICS",
+                                            "SYNCSTART", "PATCHED", "RESDELAY" };
+    bool defaults = true;
+
+    for (const char* setting : settings)
+    {
+        if (const char* value = getenv(setting))
+        {
+            printf("%s%s=%s", defaults ? "" : " ", setting, value);
+            defaults = false;
+        }
+    }
+    printf("%s\n", defaults ? "defaults" : "");
+}
+
+static UInt64 statistic(OSDictionary* dictionary, const char* key)
+{
+    OSNumber* number = OSDynamicCast(OSNumber, dictionary->getObject(key));
+    return number ? number->unsigned64BitValue() : 0;
+}
+
+// UploadStatistics the driver published, read back the way ioreg shows them, false if they
+// disagree with the controller or the upload time measured here
+static bool printStatistics(BrcmPatchRAM3* driver, const SimController::Counters& counters, double uploadMs)
+{
+    OSDictionary* statistics = OSDynamicCast(OSDictionary, driver->getProperty(kUploadStatistics));
+
+    if (!statistics)
+    {
+        printf("         no UploadStatistics\n");
+        return false;
+    }
+
+    OSString* result = OSDynamicCast(OSString, statistics->getObject("Result"));
+    UInt64 uploadTime = statistic(statistics, "UploadTime");
+    UInt64 records = statistic(statistics, "Records");
+
+    printf("         statistics %s, UploadTime %llu us, Records %llu, Bytes %llu, Retries %llu, Resumes %llu\n",
+           result ? result->getCStringNoCopy() : "?", uploadTime, records, statistic(statistics, "Bytes"),
+           statistic(statistics, "Retries"), statistic(statistics, "Resumes"));
+
+    if (OSDictionary* states = OSDynamicCast(OSDictionary, statistics->getObject("States")))
+    {
+        const char* separator = " ";
+
+        printf("         states entered at");
+        for (int state = kPreInitialize; state <= kUpdateAborted; state++)
+        {
+            if (OSNumber* entered = OSDynamicCast(OSNumber, states->getObject(BrcmPatchRAM3::getState((DeviceState)state))))
+            {
+                printf("%s%s %.1f ms", separator, BrcmPatchRAM3::getState((DeviceState)state), entered->unsigned64BitValue() / 1000.0);
+                separator = ", ";
+            }
+        }
+        printf("\n");
+    }
+
+    UInt64 answered = 0;
+
+    if (OSDictionary* roundTrips = OSDynamicCast(OSDictionary, statistics->getObject("RecordRoundTrips")))
+    {
+        char key[16];
+
+        printf("         record round trips");
+        for (UInt32 bucket = 0; bucket < kRoundTripBuckets; bucket++)
+        {
+            if (bucket < kRoundTripBuckets - 1)
+                snprintf(key, sizeof(key), "<%lluus", 64ULL << bucket);
+            else
+                snprintf(key, sizeof(key), ">=%lluus", 64ULL << (bucket - 1));
+
+            if (UInt64 count = statistic(roundTrips, key))
+                printf(" %s %llu,", key, count);
+            answered += statistic(roundTrips, key);
+        }
+        printf(" %llu answered\n", answered);
+    }
+
+    // unless commands were dropped, every record sent was executed and has a round trip
+    bool consistent = result && uploadTime <= uploadMs * 1000 &&
+                      (counters.dropped > 0 || (records == (UInt64)counters.launches &&
+                                                (!statistics->getObject("RecordRoundTrips") || answered == records)));
+
+    if (!consistent)
+        printf("         UploadStatistics disagree with the controller\n");
+    return consistent;
+}
+
+static double cpuMilliseconds(const rusage& usage)
+{
+    return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 + usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+static const char* handshakeState(SimDevice* device)
+{
+    OSBoolean* learned = OSDynamicCast(OSBoolean, device->getProperty(kHandshakeSupported));
+    return learned ? learned->isTrue() ? "learned supported" : "learned not supported" : "unknown";
+}
+
+static void setNumber(IOService* service, const char* key, UInt32 value)
+{
+    OSNumber* number = OSNumber::withNumber(value, 32);
+    service->setProperty(key, number);
+    number->release();
+}
+
+// Personality property from the environment, left to the driver's default if not set
+static void setNumber(IOService* service, const char* key, const char* setting)
+{
+    if (getenv(setting))
+        setNumber(service, key, harnessEnv(setting, 0));
+}
+
+int main(int argc, char** argv)
+{
+    const char* key = getenv("KEY") ? getenv("KEY") : "BCM20702A1_001.002.014.1443.1447_v5543";
+    int runs = harnessEnv("RUNS", 1);
+    bool aborts = harnessEnv("ABORTS", 0) != 0;
+    bool failed = false;
+    double worst = 0, budget = 0;
+
+    gHarnessRegisterHook = registered;
+
+    SimDevice* device = new SimDevice;
+    gDevice = device;
+    gHarnessNoThreads = harnessEnv("SYNCSTART", 0) != 0;
+
+    if (getenv("HANDSHAKE"))
+        device->setProperty(kHandshakeSupported, harnessEnv("HANDSHAKE", 0) != 0);
+
+    printSettings();
+
+    for (int run = 0; run < runs; run++)
+    {
+        gSimFirmwareStore = new BrcmFirmwareStore;
+        gSimFirmwareStore->start(NULL);
+
+        BrcmPatchRAM3* driver = new BrcmPatchRAM3;
+        SInt32 score = 0;
+
+        // what the personality in Info.plist provides
+        OSString* firmwareKey = OSString::withCString(key);
+        driver->setProperty(kFirmwareKey, firmwareKey);
+        firmwareKey->release();
+        setNumber(driver, "CommandWindow", harnessEnv("WINDOW", 1));
+        driver->setProperty("CoalesceRecords", harnessEnv("COALESCE", 0) != 0);
+        setNumber(driver, "FirmwarePrefetch", harnessEnv("PREFETCH", 1));
+        driver->setProperty("AdaptiveDelays", harnessEnv("ADAPTIVE", 0) != 0);
+        driver->setProperty("AsyncUpload", harnessEnv("ASYNC", 0) != 0);
+        setNumber(driver, "ResponseTimeout", "TIMEOUT");
+        setNumber(driver, "ResponseRetries", "RETRIES");
+        setNumber(driver, "UploadTimeout", "UPLOADTIMEOUT");
+
+        driver->init(NULL);
+
+        long resourceRequests = gHarnessResourceRequests;
+        double probe = harnessMilliseconds();
+        driver->probe(device, &score);
+        probe = harnessMilliseconds() - probe;
+        device->controller.resetCounters();
+
+        // the records are sent with mCompletionLock held, the credits the driver parsed last are stable
+        device->controller.creditCheck = [driver](const UInt8* command, UInt16 length) {
+            return OSReadLittleInt16(command, 0) != HCI_OPCODE_LAUNCH_RAM || driver->mCommandsInFlight < driver->mCommandCredits;
+        };
+
+        // the whole process, the controller does the same work either way
+        rusage usageStart, usageEnd;
+        long lockSleeps = gHarnessLockSleeps;
+        getrusage(RUSAGE_SELF, &usageStart);
+
+        gRegistered = 0;
+        double start = harnessMilliseconds();
+
+        if (!driver->start(device))
+        {
+            printf("  run %d: start failed\n", run);
+            return 1;
+        }
+
+        // nobody else may open the device before the firmware is in
+        double started = harnessMilliseconds();
+        bool uploadedAtReturn = gRegistered != 0;
+        bool openAtReturn = device->opened;
+
+        {
+            std::unique_lock<std::mutex> guard(gRegisteredMutex);
+            gRegisteredCondition.wait_for(guard, std::chrono::seconds(20), []() { return gRegistered != 0; });
+        }
+
+        double uploaded = gRegistered;
+        getrusage(RUSAGE_SELF, &usageEnd);
+        lockSleeps = gHarnessLockSleeps - lockSleeps;
+        driver->stop(device);
+        device->controller.creditCheck = nullptr;
+
+        SimController::Counters counters = device->controller.counters();
+        bool complete = driver->mDeviceState == (harnessEnv("PATCHED", 0) ? kUpdateNotNeeded : kUpdateComplete);
+        // every wait is cut at the budget, only the reads and records reaped after it and a controller delay may follow
+        budget = driver->mUploadTimeout + 2 * driver->mResponseTimeout + driver->mPreResetDelay;
+
+        printf("  run %d: %s in %.1f ms after probe %.1f ms, records %.1f ms, %d LAUNCH_RAM, %d outstanding max, %d without credit, %d zero credit replies\n",
+               run, BrcmPatchRAM3::getState(driver->mDeviceState), uploaded - start, probe, counters.endOfRecord > 0 ? counters.endOfRecord - counters.firstLaunch : 0,
+               counters.launches, counters.maxOutstanding, counters.withoutCredit, counters.zeroCredits);
+
+        printf("         handshake %s\n", handshakeState(device));
+
+        if (harnessEnv("ADAPTIVE", 0))
+            printReadiness(device, counters.polls);
+
+        if (getenv("ASYNC"))
+            printf("         cpu %.1f ms, %ld context switches, %ld lock sleeps\n", cpuMilliseconds(usageEnd) - cpuMilliseconds(usageStart),
+                   (usageEnd.ru_nvcsw + usageEnd.ru_nivcsw) - (usageStart.ru_nvcsw + usageStart.ru_nivcsw), lockSleeps);
+
+        if (harnessEnv("LIFECYCLE", 0))
+        {
+            printf("         start returned after %.1f ms, registered after %.1f ms, %s, device %s at registration\n",
+                   started - start, uploaded - start,
+                   uploadedAtReturn ? "uploaded before start returned" : openAtReturn ? "device open while uploading" : "device not open while uploading",
+                   gOpenAtRegistration ? "still open" : "closed");
+            failed |= !(uploadedAtReturn || openAtReturn) || gOpenAtRegistration;
+        }
+
+        if (harnessEnv("PATCHED", 0))
+        {
+            // every command answered one after the other, each a round trip and the controller's service time
+            double roundTrips = counters.commands * (harnessEnv("RTTUS", 1000) + harnessEnv("SERVICEUS", 100)) / 1000.0;
+            long requests = gHarnessResourceRequests - resourceRequests;
+            int decoded = gSimFirmwareStore->mFirmwares->getCount();
+
+            printf("         probe+start %.1f ms, %d HCI commands %.1f ms, %ld resource requests, %d firmwares decoded\n",
+                   probe + uploaded - start, counters.commands, roundTrips, requests, decoded);
+
+            if (!harnessEnv("PREFETCH", 1) && (requests > 0 || decoded > 0))
+            {
+                printf("         FAIL the firmware was loaded for a controller that needs no update\n");
+                failed = true;
+            }
+
+            // the fixed delays are sleeps, polled readiness is round trips too, with a ms of scheduling slack per command
+            if (!harnessEnv("PREFETCH", 1) && harnessEnv("ADAPTIVE", 0) && probe + uploaded - start > roundTrips + counters.commands)
+            {
+                printf("         FAIL probe and start took longer than their HCI round trips\n");
+                failed = true;
+            }
+        }
+
+        if (counters.workloopStalls > 0)
+            printf("         %d synchronous requests stuck behind a blocked completion\n", counters.workloopStalls);
+
+        if (counters.dropped > 0 || driver->mStatistics.retries > 0 || driver->mStatistics.resumes > 0)
+            printf("         %d commands unanswered, %u retries, %u resumes\n", counters.dropped, driver->mStatistics.retries, driver->mStatistics.resumes);
+
+        if (uploaded - start > budget)
+            printf("         longer than the %.0f ms the upload budget allows\n", budget);
+
+        if (harnessEnv("STATISTICS", 0))
+            failed |= !printStatistics(driver, counters, uploaded - start);
+
+        worst = std::max(worst, uploaded - start);
+        failed |= complete == aborts || counters.withoutCredit > 0 || counters.workloopStalls > 0 || uploaded == 0 || uploaded - start > budget;
+        driver->release();
+        gSimFirmwareStore->stop(NULL);
+        OSSafeReleaseNULL(gSimFirmwareStore);
+    }
+
+    if (runs > 1)
+        printf("  worst case %.1f ms, budget %.0f ms\n", worst, budget);
+
+    device->release();
+    return failed ? 1 : 0;
+}
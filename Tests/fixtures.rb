@@ -0,0 +1,62 @@
+#!/usr/bin/ruby
+
+# Generates the firmware fixtures used by the Linux harness from the shipped firmwares/*.zhx,
+# with the encoders of firmware.rb:
+#   hex/          IntelHex
+#   stream/       pre-compiled patch streams (firmware.rb --compile), deflated like the shipped .zhx
+#   zlib/ lz4/    IntelHex in a firmware container (firmware.rb --codec)
+#   zlib-stream/ lz4-stream/  patch streams in a firmware container
+#   delta/        chip family bases and deltas against them (firmware.rb --delta)
+#   resources/    the shipped firmwares with a Manifest.plist, as laid out in BrcmFirmwareRepo
+
+require_relative '../firmware'
+
+if ARGV.length != 2
+  puts "Usage: fixtures.rb <firmwares folder> <output folder>"
+  exit 1
+end
+
+input = File.expand_path(ARGV.shift)
+output = File.expand_path(ARGV.shift)
+
+%w(hex stream zlib lz4 zlib-stream lz4-stream delta resources).each { |dir| FileUtils::makedirs(File.join(output, dir)) }
+
+firmwares = Hash.new
+Dir.glob(File.join(input, "*.zhx")).sort.each do |firmware|
+  firmwares[File.basename(firmware, ".zhx")] = Zlib::Inflate.inflate(File.binread(firmware))
+end
+
+manifest = Array.new
+firmwares.each do |name, hex_data|
+  stream = compile_firmware(hex_data)
+
+  File.binwrite(File.join(output, "hex", "#{name}.hex"), hex_data)
+  File.binwrite(File.join(output, "stream", "#{name}.zhx"), Zlib::Deflate.deflate(stream, Zlib::BEST_COMPRESSION))
+  File.binwrite(File.join(output, "zlib", "#{name}.zhx"), compress_firmware(hex_data, "zlib"))
+  File.binwrite(File.join(output, "lz4", "#{name}.zhx"), compress_firmware(hex_data, "lz4"))
+  File.binwrite(File.join(output, "zlib-stream", "#{name}.zhx"), compress_firmware(stream, "zlib"))
+  File.binwrite(File.join(output, "lz4-stream", "#{name}.zhx"), compress_firmware(stream, "lz4"))
+
+  resource = File.binread(File.join(input, "#{name}.zhx"))
+  File.binwrite(File.join(output, "resources", "#{name}.zhx"), resource)
+  manifest << "  <key>#{name}.zhx</key>\n  <dict><key>Size</key><integer>#{resource.size}</integer><key>SHA1</key><data>#{Base64.strict_encode64(Digest::SHA1.digest(resource))}</data></dict>"
+end
+
+# Same family grouping as create_firmwares, the latest firmware of a family becomes its base
+families = firmwares.keys.group_by { |name| name.split("_").first.upcase }
+families.each do |family, names|
+  if names.map { |name| firmwares[name] }.uniq.size < 2
+    names.each { |name| File.binwrite(File.join(output, "delta", "#{name}.zhx"), compress_firmware(firmwares[name], "zlib")) }
+    next
+  end
+
+  base_name = "#{family}_base"
+  base_data = firmwares[names.max_by { |name| name[/_v(\d+)$/, 1].to_i }]
+  File.binwrite(File.join(output, "delta", "#{base_name}.zhx"), compress_firmware(base_data, "zlib"))
+  names.each { |name| File.binwrite(File.join(output, "delta", "#{name}.zhx"), delta_firmware(firmwares[name], base_name, base_data)) }
+end
+
+File.write(File.join(output, "resources", "Manifest.plist"),
+  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<plist version=\"1.0\">\n<dict>\n#{manifest.join("\n")}\n</dict>\n</plist>\n")
+
+puts "Generated fixtures for #{firmwares.size} firmwares in #{output}"
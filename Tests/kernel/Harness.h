@@ -0,0 +1,66 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Instrumentation of the userspace runtime (Runtime.cpp) shared by the harness programs
+ */
+
+#ifndef __BrcmPatchRAM__Harness__
+#define __BrcmPatchRAM__Harness__
+
+#include "KernelStubs.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Kernel allocations: IOMalloc, OSObject instances and OSData storage
+struct HarnessAllocations
+{
+    std::atomic<long> allocations{0};
+    std::atomic<long> bytes{0};
+    std::atomic<long> objects{0};
+    std::atomic<long> live{0};
+    std::atomic<long> peak{0};      // highest live since harnessResetPeak
+};
+
+extern HarnessAllocations gHarnessAllocations;
+
+// IOLockSleep/IOLockSleepDeadline calls, i.e. how often a thread blocked
+extern std::atomic<long> gHarnessLockSleeps;
+
+// Kernel threads started and not yet returned
+extern std::atomic<int> gHarnessThreads;
+
+// kernel_thread_start fails while set, the drivers take their synchronous fallbacks
+extern std::atomic<bool> gHarnessNoThreads;
+
+// Called from IOService::registerService
+extern void (*gHarnessRegisterHook)(IOService* service);
+
+// OSKextRequestResource serves files from $RESDIR (default "."), after $RESDELAY ms, and fails every request if $RESERR is set
+extern std::atomic<long> gHarnessResourceRequests;
+
+std::vector<UInt8> readFile(const char* path);
+OSData* readFileData(const char* path);
+void harnessResetPeak();
+double harnessMilliseconds();
+int harnessEnv(const char* name, int defaultValue);
+
+#endif /* defined(__BrcmPatchRAM__Harness__) */
@@ -0,0 +1 @@
+#include "USBStubs.h"
@@ -0,0 +1,417 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Just enough of the xnu/IOKit/libkern API for BrcmPatchRAM to build and run
+ * in userspace on Linux. Declarations only, Runtime.cpp implements them.
+ * Force-included ahead of every translation unit by the Makefile.
+ */
+
+#ifndef __BrcmPatchRAM__KernelStubs__
+#define __BrcmPatchRAM__KernelStubs__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t SInt8;
+typedef int16_t SInt16;
+typedef int32_t SInt32;
+typedef int64_t SInt64;
+
+typedef int IOReturn;
+typedef int OSReturn;
+typedef int kern_return_t;
+typedef int wait_result_t;
+typedef uint32_t IOOptionBits;
+typedef size_t IOByteCount;
+typedef uint64_t AbsoluteTime;
+typedef uint32_t OSKextRequestTag;
+typedef struct thread* thread_t;
+typedef struct task* task_t;
+typedef void (*thread_continue_t)(void* parameter, wait_result_t result);
+typedef struct kmod_info kmod_info_t;
+
+extern task_t kernel_task;
+
+#define __unused __attribute__((unused))
+
+#define kIOReturnSuccess            0
+#define kIOReturnError              1
+#define kIOReturnNoMemory           2
+#define kIOReturnAborted            3
+#define kIOReturnNoDevice           4
+#define kIOReturnNotResponding      5
+#define kIOReturnTimeout            6
+#define kIOReturnMessageTooLarge    7
+#define kIOReturnIsoTooOld          8
+#define kIOReturnIsoTooNew          9
+#define kIOReturnNotFound           10
+#define kIOReturnBadArgument        11
+#define kIOReturnNotReady           12
+#define kIOReturnBusy               13
+
+#define kOSReturnSuccess            0
+#define kOSReturnError              ((int)0xdc000001)
+#define kOSKextReturnNotFound       ((int)0xdc008011)
+
+#define KERN_SUCCESS                0
+#define KERN_FAILURE                5
+
+#define THREAD_AWAKENED             0
+#define THREAD_TIMED_OUT            1
+#define THREAD_INTERRUPTED          2
+#define THREAD_UNINT                0
+#define THREAD_INTERRUPTIBLE        1
+
+#define kIOPMPowerStateVersion1     1
+#define kIOPMPowerOn                2
+#define IOPMAckImplied              0
+
+#define kMillisecondScale           1000000
+#define kMicrosecondScale           1000
+#define kNanosecondScale            1
+
+#define kIOProviderClassKey         "IOProviderClass"
+#define kIOClassKey                 "IOClass"
+#define kIOMatchCategoryKey         "IOMatchCategory"
+#define kUSBProductString           "USB Product Name"
+#define kUSBProductID               "idProduct"
+#define kUSBVendorID                "idVendor"
+
+#define kIODirectionIn              1
+#define kIODirectionOut             2
+
+extern "C"
+{
+    extern int version_major;
+    extern int version_minor;
+
+    void IOLog(const char* format, ...);
+    void* IOMalloc(size_t size);
+    void IOFree(void* address, size_t size);
+    void IOSleep(unsigned milliseconds);
+    void bzero(void* address, size_t size);
+
+    void clock_get_uptime(uint64_t* result);
+    void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result);
+    void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result);
+    void clock_interval_to_deadline(uint32_t interval, uint32_t scaleFactor, uint64_t* result);
+
+    bool PE_parse_boot_argn(const char* name, void* value, int size);
+
+    kern_return_t kernel_thread_start(thread_continue_t continuation, void* parameter, thread_t* thread);
+    void thread_deallocate(thread_t thread);
+    void thread_terminate(thread_t thread);
+    thread_t current_thread();
+
+    const char* OSKextGetCurrentIdentifier();
+    const char* OSKextGetCurrentVersionString();
+
+    bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32* address);
+    SInt32 OSIncrementAtomic(volatile SInt32* address);
+    SInt32 OSDecrementAtomic(volatile SInt32* address);
+    SInt32 OSAddAtomic(SInt32 amount, volatile SInt32* address);
+}
+
+static inline void OSMemoryBarrier() { __sync_synchronize(); }
+static inline UInt32 OSBitAndAtomic(UInt32 mask, volatile UInt32* address) { return __sync_fetch_and_and(address, mask); }
+static inline UInt32 OSBitOrAtomic(UInt32 mask, volatile UInt32* address) { return __sync_fetch_and_or(address, mask); }
+
+static inline UInt16 OSReadLittleInt16(const volatile void* base, uintptr_t offset)
+{
+    UInt16 value;
+    memcpy(&value, (const char*)base + offset, sizeof(value));
+    return value;
+}
+
+static inline UInt32 OSReadLittleInt32(const volatile void* base, uintptr_t offset)
+{
+    UInt32 value;
+    memcpy(&value, (const char*)base + offset, sizeof(value));
+    return value;
+}
+
+static inline void OSWriteLittleInt16(volatile void* base, uintptr_t offset, UInt16 value) { memcpy((char*)base + offset, &value, sizeof(value)); }
+static inline void OSWriteLittleInt32(volatile void* base, uintptr_t offset, UInt32 value) { memcpy((char*)base + offset, &value, sizeof(value)); }
+
+typedef void (*OSKextRequestResourceCallback)(OSKextRequestTag requestTag, OSReturn result, const void* resourceData, uint32_t resourceDataLength, void* context);
+extern "C" OSReturn OSKextRequestResource(const char* kextIdentifier, const char* resourceName, OSKextRequestResourceCallback callback, void* context, OSKextRequestTag* requestTag);
+
+// IOLock is a mutex with a condition variable, so IOLockSleep/IOLockWakeup work on any event
+struct IOLock;
+
+extern "C"
+{
+    IOLock* IOLockAlloc();
+    void IOLockFree(IOLock* lock);
+    void IOLockLock(IOLock* lock);
+    void IOLockUnlock(IOLock* lock);
+    bool IOLockTryLock(IOLock* lock);
+    int IOLockSleep(IOLock* lock, void* event, int interType);
+    int IOLockSleepDeadline(IOLock* lock, void* event, uint64_t deadline, int interType);
+    void IOLockWakeup(IOLock* lock, void* event, bool oneThread);
+}
+
+struct IONamedValue
+{
+    int value;
+    const char* name;
+};
+
+const char* IOFindNameForValue(int value, const IONamedValue* namedValues);
+
+// libkern C++ runtime, reference counted objects are released when the count drops below zero
+class OSMetaClass {};
+
+class OSObject
+{
+public:
+    virtual ~OSObject() {}
+    void retain() const;
+    void release() const;
+    virtual bool init();
+    virtual void free();
+    static void* operator new(size_t size);
+    static void operator delete(void* address, size_t size);
+};
+
+#define OSDeclareDefaultStructors(className) \
+    public: className(); virtual ~className(); static const OSMetaClass* metaClass; private:
+#define OSDefineMetaClassAndStructors(className, superclassName) \
+    className::className() {} className::~className() {} const OSMetaClass* className::metaClass;
+#define OSDynamicCast(type, instance) (dynamic_cast<type*>((OSObject*)(instance)))
+#define OSSafeReleaseNULL(object) do { if (object) { (object)->release(); (object) = NULL; } } while (0)
+#define OSMemberFunctionCast(type, object, function) ((type)0)
+
+class OSString;
+class OSSymbol;
+
+class OSData : public OSObject
+{
+public:
+    static OSData* withBytes(const void* bytes, unsigned length);
+    static OSData* withCapacity(unsigned capacity);
+    static OSData* withBytesNoCopy(void* bytes, unsigned length);
+    bool appendBytes(const void* bytes, unsigned length);
+    bool appendBytes(const OSData* other);
+    const void* getBytesNoCopy() const;
+    const void* getBytesNoCopy(unsigned start, unsigned length) const;
+    unsigned getLength() const;
+    unsigned getCapacity() const;
+    unsigned ensureCapacity(unsigned capacity);
+    bool isEqualTo(const void* bytes, unsigned length) const;
+};
+
+class OSCollection : public OSObject
+{
+public:
+    virtual unsigned getCount() const;
+    virtual OSCollection* copyCollection(void* cycleDict = 0);
+};
+
+class OSArray : public OSCollection
+{
+public:
+    static OSArray* withCapacity(unsigned capacity);
+    bool setObject(const OSObject* object);
+    OSObject* getObject(unsigned index) const;
+    unsigned getCount() const;
+    void removeObject(unsigned index);
+};
+
+class OSString : public OSObject
+{
+public:
+    static OSString* withCString(const char* string);
+    static OSString* withCStringNoCopy(const char* string);
+    const char* getCStringNoCopy() const;
+    unsigned getLength() const;
+    bool isEqualTo(const char* string) const;
+};
+
+class OSSymbol : public OSString
+{
+public:
+    static const OSSymbol* withCString(const char* string);
+};
+
+class OSNumber : public OSObject
+{
+public:
+    static OSNumber* withNumber(unsigned long long value, unsigned numberOfBits);
+    unsigned unsigned32BitValue() const;
+    unsigned long long unsigned64BitValue() const;
+    void setValue(unsigned long long value);
+};
+
+class OSBoolean : public OSObject
+{
+public:
+    static OSBoolean* withBoolean(bool value);
+    bool isTrue() const;
+    bool isFalse() const;
+};
+
+extern OSBoolean* kOSBooleanTrue;
+extern OSBoolean* kOSBooleanFalse;
+
+class OSDictionary : public OSCollection
+{
+public:
+    static OSDictionary* withCapacity(unsigned capacity);
+    static OSDictionary* withDictionary(const OSDictionary* dictionary, unsigned capacity = 0);
+    bool setObject(const char* key, const OSObject* object);
+    bool setObject(const OSString* key, const OSObject* object);
+    bool setObject(const OSSymbol* key, const OSObject* object);
+    OSObject* getObject(const char* key) const;
+    OSObject* getObject(const OSString* key) const;
+    OSObject* getObject(const OSSymbol* key) const;
+    void removeObject(const char* key);
+    void removeObject(const OSString* key);
+    void removeObject(const OSSymbol* key);
+    unsigned getCount() const;
+    void flushCollection();
+};
+
+class OSOrderedSet : public OSCollection
+{
+public:
+    unsigned getCount() const;
+};
+
+class OSCollectionIterator : public OSObject
+{
+public:
+    static OSCollectionIterator* withCollection(const OSCollection* collection);
+    OSObject* getNextObject();
+    void reset();
+};
+
+OSObject* OSUnserializeXML(const char* buffer, OSString** errorString = 0);
+OSObject* OSUnserializeXML(const char* buffer, size_t bufferSize, OSString** errorString = 0);
+
+// IOKit
+struct IOPMPowerState
+{
+    unsigned long version, capabilityFlags, outputPowerCharacter, inputPowerRequirement;
+    unsigned long staticPower, unbudgetedPower, powerToAttain, timeToAttain, settleUpTime;
+    unsigned long timeToLower, settleDownTime, powerDomainBudget;
+};
+
+class IOWorkLoop;
+
+class IOEventSource : public OSObject {};
+
+class IOService : public OSObject
+{
+public:
+    virtual bool init(OSDictionary* dictionary = 0);
+    virtual void free();
+    virtual bool start(IOService* provider);
+    virtual void stop(IOService* provider);
+    virtual IOService* probe(IOService* provider, SInt32* score);
+
+    OSObject* getProperty(const char* key) const;
+    OSObject* getProperty(const OSString* key) const;
+    bool setProperty(const char* key, OSObject* object);
+    bool setProperty(const char* key, bool value);
+    bool setProperty(const char* key, unsigned long long value, unsigned numberOfBits);
+    bool setProperty(const char* key, const char* value);
+    bool setProperty(const OSSymbol* key, OSObject* object);
+    void removeProperty(const char* key);
+
+    void registerService(IOOptionBits options = 0);
+    virtual const char* stringFromReturn(IOReturn code);
+    IOWorkLoop* getWorkLoop() const;
+    bool isInactive() const;
+    const char* getName() const;
+    static IOService* waitForMatchingService(OSDictionary* matching, uint64_t timeout);
+    static OSDictionary* serviceMatching(const char* className);
+
+    void PMinit();
+    void PMstop();
+    IOReturn registerPowerDriver(IOService* controllingDriver, IOPMPowerState* powerStates, unsigned long numberOfStates);
+    IOReturn joinPMtree(IOService* driver);
+    void makeUsable();
+    virtual IOReturn setPowerState(unsigned long powerStateOrdinal, IOService* whatDevice);
+};
+
+class IOMemoryDescriptor : public OSObject
+{
+public:
+    static IOMemoryDescriptor* withAddress(void* address, IOByteCount length, int direction);
+    IOReturn prepare(int direction = 0);
+    IOReturn complete(int direction = 0);
+    IOByteCount getLength() const;
+    IOByteCount readBytes(IOByteCount offset, void* bytes, IOByteCount length) const;
+};
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor
+{
+public:
+    static IOBufferMemoryDescriptor* inTaskWithOptions(task_t inTask, IOOptionBits options, IOByteCount capacity, IOByteCount alignment = 1);
+    void* getBytesNoCopy();
+};
+
+class IOInterruptEventSource : public IOEventSource
+{
+public:
+    typedef void (*Action)(OSObject* owner, IOInterruptEventSource* sender, int count);
+    static IOInterruptEventSource* interruptEventSource(OSObject* owner, Action action);
+    void interruptOccurred(void* nub, void* provider, int source);
+};
+
+typedef IOInterruptEventSource::Action IOInterruptEventAction;
+
+class IOTimerEventSource : public IOEventSource
+{
+public:
+    typedef IOReturn (*Action)(OSObject* owner, ...);
+    static IOTimerEventSource* timerEventSource(OSObject* owner, Action action);
+    IOReturn setTimeoutMS(UInt32 milliseconds);
+    void cancelTimeout();
+};
+
+class IOWorkLoop : public OSObject
+{
+public:
+    IOReturn addEventSource(IOEventSource* source);
+    IOReturn removeEventSource(IOEventSource* source);
+};
+
+class IOCatalogue
+{
+public:
+    OSOrderedSet* findDrivers(OSDictionary* matching, SInt32* generationCount);
+    bool addDrivers(OSArray* drivers, bool doNubMatching);
+    bool removeDrivers(OSDictionary* matching, bool doNubMatching);
+    bool startMatching(OSDictionary* matching);
+    IOReturn terminateDriversForModule(OSString* moduleName, bool unload);
+};
+
+extern IOCatalogue* gIOCatalogue;
+
+#endif /* defined(__BrcmPatchRAM__KernelStubs__) */
@@ -0,0 +1,790 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Userspace implementation of KernelStubs.h on top of pthreads, the C++ library, zlib and OpenSSL
+ */
+
+#include "Harness.h"
+#include <libkern/crypto/sha1.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <regex>
+#include <thread>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+HarnessAllocations gHarnessAllocations;
+std::atomic<long> gHarnessLockSleeps{0};
+std::atomic<int> gHarnessThreads{0};
+std::atomic<bool> gHarnessNoThreads{false};
+std::atomic<long> gHarnessResourceRequests{0};
+void (*gHarnessRegisterHook)(IOService* service) = NULL;
+
+static void countAllocation(long size)
+{
+    gHarnessAllocations.allocations++;
+    gHarnessAllocations.bytes += size;
+    long live = gHarnessAllocations.live += size;
+    long peak = gHarnessAllocations.peak;
+
+    while (live > peak && !gHarnessAllocations.peak.compare_exchange_weak(peak, live));
+}
+
+void harnessResetPeak()
+{
+    gHarnessAllocations.peak = gHarnessAllocations.live.load();
+}
+
+std::vector<UInt8> readFile(const char* path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<UInt8>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+OSData* readFileData(const char* path)
+{
+    std::vector<UInt8> data = readFile(path);
+    return OSData::withBytes(data.data(), (unsigned)data.size());
+}
+
+double harnessMilliseconds()
+{
+    static auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int harnessEnv(const char* name, int defaultValue)
+{
+    const char* value = getenv(name);
+    return value ? atoi(value) : defaultValue;
+}
+
+// xnu
+
+extern "C"
+{
+
+int version_major = 19;
+int version_minor = 0;
+
+void IOLog(const char* format, ...)
+{
+    const char* quiet = getenv("QUIET");
+    if (quiet && *quiet)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void* IOMalloc(size_t size)
+{
+    countAllocation(size);
+    return malloc(size);
+}
+
+void IOFree(void* address, size_t size)
+{
+    if (address)
+        gHarnessAllocations.live -= size;
+    free(address);
+}
+
+void IOSleep(unsigned milliseconds)
+{
+    usleep(milliseconds * 1000);
+}
+
+void bzero(void* address, size_t size)
+{
+    memset(address, 0, size);
+}
+
+// Absolute time is in nanoseconds of CLOCK_MONOTONIC
+void clock_get_uptime(uint64_t* result)
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *result = now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result)
+{
+    *result = abstime;
+}
+
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result)
+{
+    *result = nanoseconds;
+}
+
+void clock_interval_to_deadline(uint32_t interval, uint32_t scaleFactor, uint64_t* result)
+{
+    uint64_t now;
+    clock_get_uptime(&now);
+    *result = now + (uint64_t)interval * scaleFactor;
+}
+
+bool PE_parse_boot_argn(const char* name, void* value, int size)
+{
+    return false;
+}
+
+kern_return_t kernel_thread_start(thread_continue_t continuation, void* parameter, thread_t* thread)
+{
+    if (gHarnessNoThreads)
+        return KERN_FAILURE;
+
+    gHarnessThreads++;
+    std::thread([=]() {
+        continuation(parameter, THREAD_AWAKENED);
+        gHarnessThreads--;
+    }).detach();
+    *thread = (thread_t)1;
+    return KERN_SUCCESS;
+}
+
+void thread_deallocate(thread_t thread) {}
+void thread_terminate(thread_t thread) {}
+thread_t current_thread() { return (thread_t)1; }
+
+const char* OSKextGetCurrentIdentifier() { return "as.acidanthera.BrcmPatchRAM.Tests"; }
+const char* OSKextGetCurrentVersionString() { return "0.0"; }
+
+bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32* address) { return __sync_bool_compare_and_swap(address, oldValue, newValue); }
+SInt32 OSIncrementAtomic(volatile SInt32* address) { return __sync_fetch_and_add(address, 1); }
+SInt32 OSDecrementAtomic(volatile SInt32* address) { return __sync_fetch_and_sub(address, 1); }
+SInt32 OSAddAtomic(SInt32 amount, volatile SInt32* address) { return __sync_fetch_and_add(address, amount); }
+
+// Resources are read on their own thread and handed to the callback in a buffer only valid during the callback, like kextd does
+OSReturn OSKextRequestResource(const char* kextIdentifier, const char* resourceName, OSKextRequestResourceCallback callback, void* context, OSKextRequestTag* requestTag)
+{
+    const char* directory = getenv("RESDIR");
+    std::string path = std::string(directory ? directory : ".") + "/" + resourceName;
+
+    gHarnessResourceRequests++;
+    std::thread([=]() {
+        usleep(harnessEnv("RESDELAY", 0) * 1000);
+
+        if (getenv("RESERR"))
+        {
+            callback(0, kOSReturnError, NULL, 0, context);
+            return;
+        }
+
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file)
+        {
+            callback(0, kOSKextReturnNotFound, NULL, 0, context);
+            return;
+        }
+
+        fseek(file, 0, SEEK_END);
+        long length = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        void* data = malloc(length);
+        length = fread(data, 1, length, file);
+        fclose(file);
+
+        callback(0, kOSReturnSuccess, data, (uint32_t)length, context);
+        free(data);
+    }).detach();
+
+    return kOSReturnSuccess;
+}
+
+// libkern SHA1 on top of OpenSSL
+static_assert(sizeof(SHA_CTX) <= sizeof(SHA1_CTX), "SHA1_CTX too small");
+
+void SHA1Init(SHA1_CTX* context) { SHA1_Init((SHA_CTX*)context); }
+void SHA1Update(SHA1_CTX* context, const void* data, size_t length) { SHA1_Update((SHA_CTX*)context, data, length); }
+void SHA1Final(void* digest, SHA1_CTX* context) { SHA1_Final((unsigned char*)digest, (SHA_CTX*)context); }
+
+}
+
+// Locks
+
+struct IOLock
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+};
+
+extern "C"
+{
+
+IOLock* IOLockAlloc()
+{
+    IOLock* lock = new IOLock;
+    pthread_condattr_t attributes;
+
+    pthread_mutex_init(&lock->mutex, NULL);
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&lock->condition, &attributes);
+    return lock;
+}
+
+void IOLockFree(IOLock* lock)
+{
+    pthread_cond_destroy(&lock->condition);
+    pthread_mutex_destroy(&lock->mutex);
+    delete lock;
+}
+
+void IOLockLock(IOLock* lock) { pthread_mutex_lock(&lock->mutex); }
+void IOLockUnlock(IOLock* lock) { pthread_mutex_unlock(&lock->mutex); }
+bool IOLockTryLock(IOLock* lock) { return pthread_mutex_trylock(&lock->mutex) == 0; }
+
+// Events are not tracked, every wakeup wakes all sleepers of the lock, which then recheck their condition
+int IOLockSleep(IOLock* lock, void* event, int interType)
+{
+    gHarnessLockSleeps++;
+    pthread_cond_wait(&lock->condition, &lock->mutex);
+    return THREAD_AWAKENED;
+}
+
+int IOLockSleepDeadline(IOLock* lock, void* event, uint64_t deadline, int interType)
+{
+    timespec until = { (time_t)(deadline / 1000000000ULL), (long)(deadline % 1000000000ULL) };
+
+    gHarnessLockSleeps++;
+    return pthread_cond_timedwait(&lock->condition, &lock->mutex, &until) ? THREAD_TIMED_OUT : THREAD_AWAKENED;
+}
+
+void IOLockWakeup(IOLock* lock, void* event, bool oneThread)
+{
+    pthread_cond_broadcast(&lock->condition);
+}
+
+}
+
+const char* IOFindNameForValue(int value, const IONamedValue* namedValues)
+{
+    for (; namedValues->name; namedValues++)
+        if (namedValues->value == value)
+            return namedValues->name;
+
+    return "<unknown>";
+}
+
+// libkern C++
+
+static std::mutex gRetainLock;
+static std::map<const OSObject*, int> gRetainCounts;
+
+void OSObject::retain() const
+{
+    std::lock_guard<std::mutex> guard(gRetainLock);
+    gRetainCounts[this]++;
+}
+
+void OSObject::release() const
+{
+    std::unique_lock<std::mutex> guard(gRetainLock);
+
+    if (--gRetainCounts[this] < 0)
+    {
+        gRetainCounts.erase(this);
+        guard.unlock();
+        delete this;
+    }
+}
+
+bool OSObject::init() { return true; }
+void OSObject::free() {}
+
+void* OSObject::operator new(size_t size)
+{
+    gHarnessAllocations.objects++;
+    countAllocation(size);
+    return malloc(size);
+}
+
+void OSObject::operator delete(void* address, size_t size)
+{
+    gHarnessAllocations.live -= size;
+    ::free(address);
+}
+
+// OSData keeps its bytes in a vector, growth is counted as one allocation of the new capacity
+struct OSDataStorage : OSData
+{
+    std::vector<UInt8> bytes;
+    const void* borrowed = NULL;
+    unsigned borrowedLength = 0;
+
+    ~OSDataStorage() { gHarnessAllocations.live -= bytes.capacity(); }
+
+    template <typename Change> void update(Change change)
+    {
+        size_t capacity = bytes.capacity();
+        change();
+        if (bytes.capacity() != capacity)
+        {
+            countAllocation(bytes.capacity());
+            gHarnessAllocations.live -= capacity;
+        }
+    }
+};
+
+static OSDataStorage* storage(const OSData* data) { return (OSDataStorage*)data; }
+
+OSData* OSData::withBytes(const void* bytes, unsigned length)
+{
+    OSDataStorage* data = new OSDataStorage;
+    data->update([&]() { data->bytes.assign((const UInt8*)bytes, (const UInt8*)bytes + length); });
+    return data;
+}
+
+OSData* OSData::withCapacity(unsigned capacity)
+{
+    OSDataStorage* data = new OSDataStorage;
+    data->update([&]() { data->bytes.reserve(capacity); });
+    return data;
+}
+
+OSData* OSData::withBytesNoCopy(void* bytes, unsigned length)
+{
+    OSDataStorage* data = new OSDataStorage;
+    data->borrowed = bytes;
+    data->borrowedLength = length;
+    return data;
+}
+
+// Like libkern, appending grows the capacity in page sized steps
+bool OSData::appendBytes(const void* bytes, unsigned length)
+{
+    OSDataStorage* data = storage(this);
+
+    if (data->borrowed)
+        return false;
+
+    data->update([&]() {
+        size_t size = data->bytes.size() + length;
+        if (size > data->bytes.capacity())
+            data->bytes.reserve((size + 4095) & ~(size_t)4095);
+        if (bytes)
+            data->bytes.insert(data->bytes.end(), (const UInt8*)bytes, (const UInt8*)bytes + length);
+        else
+            data->bytes.resize(size);
+    });
+    return true;
+}
+
+bool OSData::appendBytes(const OSData* other)
+{
+    return appendBytes(other->getBytesNoCopy(), other->getLength());
+}
+
+const void* OSData::getBytesNoCopy() const
+{
+    OSDataStorage* data = storage(this);
+
+    if (data->borrowed)
+        return data->borrowed;
+    return data->bytes.empty() ? NULL : data->bytes.data();
+}
+
+const void* OSData::getBytesNoCopy(unsigned start, unsigned length) const
+{
+    if (start + length > getLength())
+        return NULL;
+    return (const UInt8*)getBytesNoCopy() + start;
+}
+
+unsigned OSData::getLength() const
+{
+    OSDataStorage* data = storage(this);
+    return data->borrowed ? data->borrowedLength : (unsigned)data->bytes.size();
+}
+
+unsigned OSData::getCapacity() const
+{
+    OSDataStorage* data = storage(this);
+    return data->borrowed ? data->borrowedLength : (unsigned)data->bytes.capacity();
+}
+
+unsigned OSData::ensureCapacity(unsigned capacity)
+{
+    OSDataStorage* data = storage(this);
+
+    if (!data->borrowed)
+        data->update([&]() { data->bytes.reserve(capacity); });
+    return getCapacity();
+}
+
+bool OSData::isEqualTo(const void* bytes, unsigned length) const
+{
+    return length == getLength() && (!length || !memcmp(bytes, getBytesNoCopy(), length));
+}
+
+unsigned OSCollection::getCount() const { return 0; }
+OSCollection* OSCollection::copyCollection(void* cycleDict) { return NULL; }
+
+struct OSArrayStorage : OSArray
+{
+    std::vector<const OSObject*> objects;
+    ~OSArrayStorage() { for (const OSObject* object : objects) object->release(); }
+};
+
+OSArray* OSArray::withCapacity(unsigned capacity)
+{
+    OSArrayStorage* array = new OSArrayStorage;
+    array->objects.reserve(capacity);
+    return array;
+}
+
+bool OSArray::setObject(const OSObject* object)
+{
+    object->retain();
+    ((OSArrayStorage*)this)->objects.push_back(object);
+    return true;
+}
+
+OSObject* OSArray::getObject(unsigned index) const
+{
+    const std::vector<const OSObject*> &objects = ((const OSArrayStorage*)this)->objects;
+    return index < objects.size() ? (OSObject*)objects[index] : NULL;
+}
+
+unsigned OSArray::getCount() const
+{
+    return (unsigned)((const OSArrayStorage*)this)->objects.size();
+}
+
+void OSArray::removeObject(unsigned index)
+{
+    std::vector<const OSObject*> &objects = ((OSArrayStorage*)this)->objects;
+
+    if (index < objects.size())
+    {
+        objects[index]->release();
+        objects.erase(objects.begin() + index);
+    }
+}
+
+struct OSStringStorage : OSSymbol
+{
+    std::string string;
+};
+
+OSString* OSString::withCString(const char* string)
+{
+    OSStringStorage* result = new OSStringStorage;
+    result->string = string;
+    return result;
+}
+
+OSString* OSString::withCStringNoCopy(const char* string) { return withCString(string); }
+const OSSymbol* OSSymbol::withCString(const char* string) { return (const OSSymbol*)OSString::withCString(string); }
+const char* OSString::getCStringNoCopy() const { return ((const OSStringStorage*)this)->string.c_str(); }
+unsigned OSString::getLength() const { return (unsigned)((const OSStringStorage*)this)->string.size(); }
+bool OSString::isEqualTo(const char* string) const { return ((const OSStringStorage*)this)->string == string; }
+
+struct OSNumberStorage : OSNumber
+{
+    unsigned long long value;
+};
+
+OSNumber* OSNumber::withNumber(unsigned long long value, unsigned numberOfBits)
+{
+    OSNumberStorage* number = new OSNumberStorage;
+    number->value = value;
+    return number;
+}
+
+unsigned OSNumber::unsigned32BitValue() const { return (unsigned)((const OSNumberStorage*)this)->value; }
+unsigned long long OSNumber::unsigned64BitValue() const { return ((const OSNumberStorage*)this)->value; }
+void OSNumber::setValue(unsigned long long value) { ((OSNumberStorage*)this)->value = value; }
+
+OSBoolean* kOSBooleanTrue = new OSBoolean;
+OSBoolean* kOSBooleanFalse = new OSBoolean;
+
+OSBoolean* OSBoolean::withBoolean(bool value) { return value ? kOSBooleanTrue : kOSBooleanFalse; }
+bool OSBoolean::isTrue() const { return this == kOSBooleanTrue; }
+bool OSBoolean::isFalse() const { return this != kOSBooleanTrue; }
+
+struct OSDictionaryStorage : OSDictionary
+{
+    std::map<std::string, const OSObject*> objects;
+    ~OSDictionaryStorage() { flushCollection(); }
+};
+
+static OSDictionaryStorage* storage(const OSDictionary* dictionary) { return (OSDictionaryStorage*)dictionary; }
+
+OSDictionary* OSDictionary::withCapacity(unsigned capacity)
+{
+    return new OSDictionaryStorage;
+}
+
+OSDictionary* OSDictionary::withDictionary(const OSDictionary* dictionary, unsigned capacity)
+{
+    OSDictionary* result = withCapacity(capacity);
+
+    for (auto &entry : storage(dictionary)->objects)
+        result->setObject(entry.first.c_str(), entry.second);
+    return result;
+}
+
+bool OSDictionary::setObject(const char* key, const OSObject* object)
+{
+    object->retain();
+
+    const OSObject* &slot = storage(this)->objects[key];
+    if (slot)
+        slot->release();
+    slot = object;
+    return true;
+}
+
+bool OSDictionary::setObject(const OSString* key, const OSObject* object) { return setObject(key->getCStringNoCopy(), object); }
+bool OSDictionary::setObject(const OSSymbol* key, const OSObject* object) { return setObject(key->getCStringNoCopy(), object); }
+
+OSObject* OSDictionary::getObject(const char* key) const
+{
+    auto entry = storage(this)->objects.find(key);
+    return entry == storage(this)->objects.end() ? NULL : (OSObject*)entry->second;
+}
+
+OSObject* OSDictionary::getObject(const OSString* key) const { return getObject(key->getCStringNoCopy()); }
+OSObject* OSDictionary::getObject(const OSSymbol* key) const { return getObject(key->getCStringNoCopy()); }
+
+void OSDictionary::removeObject(const char* key)
+{
+    auto entry = storage(this)->objects.find(key);
+
+    if (entry != storage(this)->objects.end())
+    {
+        entry->second->release();
+        storage(this)->objects.erase(entry);
+    }
+}
+
+void OSDictionary::removeObject(const OSString* key) { removeObject(key->getCStringNoCopy()); }
+void OSDictionary::removeObject(const OSSymbol* key) { removeObject(key->getCStringNoCopy()); }
+unsigned OSDictionary::getCount() const { return (unsigned)storage(this)->objects.size(); }
+
+void OSDictionary::flushCollection()
+{
+    for (auto &entry : storage(this)->objects)
+        entry.second->release();
+    storage(this)->objects.clear();
+}
+
+unsigned OSOrderedSet::getCount() const { return 0; }
+
+// Only arrays are iterated
+struct OSCollectionIteratorStorage : OSCollectionIterator
+{
+    const OSArray* array;
+    unsigned index = 0;
+};
+
+OSCollectionIterator* OSCollectionIterator::withCollection(const OSCollection* collection)
+{
+    OSCollectionIteratorStorage* iterator = new OSCollectionIteratorStorage;
+    iterator->array = OSDynamicCast(const OSArray, collection);
+    return iterator;
+}
+
+OSObject* OSCollectionIterator::getNextObject()
+{
+    OSCollectionIteratorStorage* iterator = (OSCollectionIteratorStorage*)this;
+    return iterator->array ? iterator->array->getObject(iterator->index++) : NULL;
+}
+
+void OSCollectionIterator::reset() { ((OSCollectionIteratorStorage*)this)->index = 0; }
+
+// Reads the flat name -> { Size, SHA1 } dictionary of Manifest.plist, nothing else
+OSObject* OSUnserializeXML(const char* buffer, size_t bufferSize, OSString** errorString)
+{
+    std::string plist(buffer, strnlen(buffer, bufferSize));
+    std::regex entryPattern("<key>([^<]*)</key>\\s*<dict><key>Size</key><integer>(\\d+)</integer><key>SHA1</key><data>([^<]*)</data></dict>");
+    OSDictionary* result = OSDictionary::withCapacity(0);
+
+    for (std::sregex_iterator match(plist.begin(), plist.end(), entryPattern), end; match != end; ++match)
+    {
+        OSDictionary* entry = OSDictionary::withCapacity(2);
+        std::string digest = (*match)[3];
+        unsigned char bytes[64];
+
+        entry->setObject("Size", OSNumber::withNumber(std::stoull((*match)[2]), 32));
+        if (EVP_DecodeBlock(bytes, (const unsigned char*)digest.data(), (int)digest.size()) >= SHA1_RESULTLEN)
+            entry->setObject("SHA1", OSData::withBytes(bytes, SHA1_RESULTLEN));
+        result->setObject((*match)[1].str().c_str(), entry);
+    }
+
+    return result;
+}
+
+OSObject* OSUnserializeXML(const char* buffer, OSString** errorString)
+{
+    return OSUnserializeXML(buffer, strlen(buffer), errorString);
+}
+
+// IOKit, properties are kept per service
+
+static std::mutex gPropertyLock;
+static std::map<const IOService*, std::map<std::string, OSObject*>> gProperties;
+
+bool IOService::init(OSDictionary* dictionary) { return true; }
+void IOService::free() {}
+bool IOService::start(IOService* provider) { return true; }
+void IOService::stop(IOService* provider) {}
+IOService* IOService::probe(IOService* provider, SInt32* score) { return this; }
+
+OSObject* IOService::getProperty(const char* key) const
+{
+    std::lock_guard<std::mutex> guard(gPropertyLock);
+    auto &properties = gProperties[this];
+    auto entry = properties.find(key);
+    return entry == properties.end() ? NULL : entry->second;
+}
+
+OSObject* IOService::getProperty(const OSString* key) const { return getProperty(key->getCStringNoCopy()); }
+
+bool IOService::setProperty(const char* key, OSObject* object)
+{
+    std::lock_guard<std::mutex> guard(gPropertyLock);
+    OSObject* &slot = gProperties[this][key];
+
+    object->retain();
+    if (slot)
+        slot->release();
+    slot = object;
+    return true;
+}
+
+bool IOService::setProperty(const char* key, bool value) { return setProperty(key, value ? kOSBooleanTrue : kOSBooleanFalse); }
+bool IOService::setProperty(const char* key, unsigned long long value, unsigned numberOfBits) { return setProperty(key, OSNumber::withNumber(value, numberOfBits)); }
+bool IOService::setProperty(const char* key, const char* value) { return setProperty(key, OSString::withCString(value)); }
+bool IOService::setProperty(const OSSymbol* key, OSObject* object) { return setProperty(key->getCStringNoCopy(), object); }
+
+void IOService::removeProperty(const char* key)
+{
+    std::lock_guard<std::mutex> guard(gPropertyLock);
+    gProperties[this].erase(key);
+}
+
+void IOService::registerService(IOOptionBits options)
+{
+    if (gHarnessRegisterHook)
+        gHarnessRegisterHook(this);
+}
+
+const char* IOService::stringFromReturn(IOReturn code) { return "<IOReturn>"; }
+IOWorkLoop* IOService::getWorkLoop() const { return NULL; }
+bool IOService::isInactive() const { return false; }
+const char* IOService::getName() const { return "IOService"; }
+OSDictionary* IOService::serviceMatching(const char* className) { return NULL; }
+
+void IOService::PMinit() {}
+void IOService::PMstop() {}
+IOReturn IOService::registerPowerDriver(IOService* controllingDriver, IOPMPowerState* powerStates, unsigned long numberOfStates) { return kIOReturnSuccess; }
+IOReturn IOService::joinPMtree(IOService* driver) { return kIOReturnSuccess; }
+void IOService::makeUsable() {}
+IOReturn IOService::setPowerState(unsigned long powerStateOrdinal, IOService* whatDevice) { return IOPMAckImplied; }
+
+struct IOBufferMemoryDescriptorStorage : IOBufferMemoryDescriptor
+{
+    std::vector<UInt8> bytes;
+};
+
+struct IOMemoryDescriptorStorage : IOMemoryDescriptor
+{
+    void* address;
+    IOByteCount length;
+};
+
+IOBufferMemoryDescriptor* IOBufferMemoryDescriptor::inTaskWithOptions(task_t inTask, IOOptionBits options, IOByteCount capacity, IOByteCount alignment)
+{
+    IOBufferMemoryDescriptorStorage* buffer = new IOBufferMemoryDescriptorStorage;
+    buffer->bytes.resize(capacity);
+    return buffer;
+}
+
+void* IOBufferMemoryDescriptor::getBytesNoCopy() { return ((IOBufferMemoryDescriptorStorage*)this)->bytes.data(); }
+
+IOMemoryDescriptor* IOMemoryDescriptor::withAddress(void* address, IOByteCount length, int direction)
+{
+    IOMemoryDescriptorStorage* descriptor = new IOMemoryDescriptorStorage;
+    descriptor->address = address;
+    descriptor->length = length;
+    return descriptor;
+}
+
+IOReturn IOMemoryDescriptor::prepare(int direction) { return kIOReturnSuccess; }
+IOReturn IOMemoryDescriptor::complete(int direction) { return kIOReturnSuccess; }
+
+IOByteCount IOMemoryDescriptor::getLength() const
+{
+    if (const IOBufferMemoryDescriptorStorage* buffer = dynamic_cast<const IOBufferMemoryDescriptorStorage*>(this))
+        return buffer->bytes.size();
+    return ((const IOMemoryDescriptorStorage*)this)->length;
+}
+
+IOByteCount IOMemoryDescriptor::readBytes(IOByteCount offset, void* bytes, IOByteCount length) const
+{
+    const UInt8* address;
+
+    if (const IOBufferMemoryDescriptorStorage* buffer = dynamic_cast<const IOBufferMemoryDescriptorStorage*>(this))
+        address = buffer->bytes.data();
+    else
+        address = (const UInt8*)((const IOMemoryDescriptorStorage*)this)->address;
+
+    length = std::min(length, getLength() - offset);
+    memcpy(bytes, address + offset, length);
+    return length;
+}
+
+IOInterruptEventSource* IOInterruptEventSource::interruptEventSource(OSObject* owner, Action action) { return new IOInterruptEventSource; }
+void IOInterruptEventSource::interruptOccurred(void* nub, void* provider, int source) {}
+IOTimerEventSource* IOTimerEventSource::timerEventSource(OSObject* owner, Action action) { return new IOTimerEventSource; }
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 milliseconds) { return kIOReturnSuccess; }
+void IOTimerEventSource::cancelTimeout() {}
+IOReturn IOWorkLoop::addEventSource(IOEventSource* source) { return kIOReturnSuccess; }
+IOReturn IOWorkLoop::removeEventSource(IOEventSource* source) { return kIOReturnSuccess; }
+
+// The catalogue has no drivers, so every publication goes through
+static IOCatalogue gCatalogue;
+IOCatalogue* gIOCatalogue = &gCatalogue;
+
+OSOrderedSet* IOCatalogue::findDrivers(OSDictionary* matching, SInt32* generationCount) { return NULL; }
+bool IOCatalogue::addDrivers(OSArray* drivers, bool doNubMatching) { return true; }
+bool IOCatalogue::removeDrivers(OSDictionary* matching, bool doNubMatching) { return true; }
+bool IOCatalogue::startMatching(OSDictionary* matching) { return true; }
+IOReturn IOCatalogue::terminateDriversForModule(OSString* moduleName, bool unload) { return kIOReturnSuccess; }
+
+task_t kernel_task;
@@ -0,0 +1,84 @@
+/*
+ * IOUSBFamily (legacy) and IOUSBHostFamily types used by USBDeviceShim, for the Linux harness
+ */
+
+#ifndef __BrcmPatchRAM__USBStubs__
+#define __BrcmPatchRAM__USBStubs__
+
+#include "KernelStubs.h"
+
+class IOUSBDevice : public IOService {};
+class IOUSBInterface : public IOService {};
+class IOUSBPipe : public OSObject {};
+
+class IOUSBHostDevice : public IOService {};
+class IOUSBHostInterface : public IOService {};
+class IOUSBHostPipe : public OSObject {};
+
+typedef void (*IOUSBCompletionAction)(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining);
+
+struct IOUSBCompletion
+{
+    void* target;
+    IOUSBCompletionAction action;
+    void* parameter;
+};
+
+typedef void (*IOUSBHostCompletionAction)(void* owner, void* parameter, IOReturn status, uint32_t bytesTransferred);
+
+struct IOUSBHostCompletion
+{
+    void* owner;
+    IOUSBHostCompletionAction action;
+    void* parameter;
+};
+
+struct IOUSBConfigurationDescriptor { UInt8 bConfigurationValue; };
+struct IOUSBEndpointDescriptor { UInt8 bEndpointAddress; };
+
+namespace StandardUSB
+{
+    struct ConfigurationDescriptor { UInt8 bConfigurationValue; };
+    struct EndpointDescriptor { UInt8 bEndpointAddress; };
+}
+
+enum { kUSBOut = 0, kUSBIn = 1 };
+enum { kUSBBulk = 2, kUSBInterrupt = 3 };
+
+enum
+{
+    kIOUSBPipeStalled = 0x100,
+    kIOUSBTransactionTimeout,
+    kIOUSBUnknownPipeErr,
+    kIOUSBTooManyPipesErr,
+    kIOUSBNoAsyncPortErr,
+    kIOUSBNotEnoughPowerErr,
+    kIOUSBEndpointNotFound,
+    kIOUSBConfigNotFound,
+    kIOUSBTransactionReturned,
+    kIOUSBInterfaceNotFound,
+    kIOUSBLowLatencyBufferNotPreviouslyAllocated,
+    kIOUSBLowLatencyFrameListNotPreviouslyAllocated,
+    kIOUSBHighSpeedSplitError,
+    kIOUSBSyncRequestOnWLThread,
+    kIOUSBDeviceNotHighSpeed,
+    kIOUSBLinkErr,
+    kIOUSBNotSent2Err,
+    kIOUSBNotSent1Err,
+    kIOUSBNotEnoughPipesErr,
+    kIOUSBBufferUnderrunErr,
+    kIOUSBBufferOverrunErr,
+    kIOUSBReserved2Err,
+    kIOUSBReserved1Err,
+    kIOUSBWrongPIDErr,
+    kIOUSBPIDCheckErr,
+    kIOUSBDataToggleErr,
+    kIOUSBBitstufErr,
+    kIOUSBCRCErr,
+};
+
+#define kIOUSBClearPipeStallNotRecursive 0x200
+
+typedef UInt16 USBStatus;
+
+#endif /* defined(__BrcmPatchRAM__USBStubs__) */
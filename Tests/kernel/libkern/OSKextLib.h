@@ -0,0 +1 @@
+#include "KernelStubs.h"
@@ -0,0 +1,17 @@
+#ifndef __BrcmPatchRAM__sha1__
+#define __BrcmPatchRAM__sha1__
+
+#include "KernelStubs.h"
+
+#define SHA1_RESULTLEN 20
+
+typedef struct { unsigned char opaque[128]; } SHA1_CTX;
+
+extern "C"
+{
+    void SHA1Init(SHA1_CTX* context);
+    void SHA1Update(SHA1_CTX* context, const void* data, size_t length);
+    void SHA1Final(void* digest, SHA1_CTX* context);
+}
+
+#endif /* defined(__BrcmPatchRAM__sha1__) */
@@ -0,0 +1 @@
+#include <zlib.h>
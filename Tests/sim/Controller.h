@@ -0,0 +1,427 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Simulated Broadcom controller behind the USB shims (Shims.h)
+ *
+ * Include after the driver sources, it needs USBCOMPLETION and the HCI opcodes.
+ * HCI commands travel half of the round trip to the controller, which executes
+ * them one after the other, and the events travel the other half back. Events
+ * are only delivered into interrupt reads queued by the driver.
+ *
+ *   RTTUS       USB round trip in us (default 1000)
+ *   SERVICEUS   time the controller spends on each command in us (default 100)
+ *   CREDITS     Num_HCI_Command_Packets reported in every event (default 1)
+ *   ZEROCREDIT  every Nth LAUNCH_RAM reports no credits, as does every event until a NOP
+ *               Command Complete (odd N) or Command Status (even N) returns them 2 ms later
+ *   READYRESET  ms after HCI_RESET until HCI_LOCAL_VERSION succeeds (default 40), before
+ *               that it fails with Command Disallowed
+ *   READYMINI   the same after DOWNLOAD_MINIDRIVER (default 30)
+ *   DROPPOLLS   the first N HCI_LOCAL_VERSION polls are never answered
+ *   VENDOR      send the 0xFF vendor event VENDORDELAY ms (default 30) after END_OF_RECORD,
+ *               the handshake telling the driver the controller is ready for the reset
+ *   WORKLOOP    synchronous requests complete on the thread delivering the completions,
+ *               like on the USB workloop, so they cannot while a completion handler blocks
+ *   DROPOP      opcode in hex of commands the controller takes but never answers, the
+ *               first DROPN of them (default 1)
+ *   WEDGEAFTER  the controller answers the first N commands of an upload, then nothing
+ *   PATCHED     firmware build READ_VERBOSE_CONFIG reports, a controller already running
+ *               patched firmware (default 0, the ROM)
+ */
+
+#ifndef __BrcmPatchRAM__SimController__
+#define __BrcmPatchRAM__SimController__
+
+#include "Harness.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Completion handed back to the driver, the target field changed its name with IOUSBHostFamily
+static void simComplete(const USBCOMPLETION& completion, IOReturn status, UInt32 bytes, UInt32 requested)
+{
+#if defined(TARGET_ELCAPITAN) || defined(TARGET_CATALINA)
+    completion.action(completion.owner, completion.parameter, status, bytes);
+#else
+    completion.action(completion.target, completion.parameter, status, requested - bytes);
+#endif
+}
+
+class SimController
+{
+public:
+    struct Event
+    {
+        double due;
+        std::vector<UInt8> data;
+    };
+
+    struct Transfer
+    {
+        double due;
+        USBCOMPLETION completion;
+        IOMemoryDescriptor* buffer;
+    };
+
+    // Counters of the last upload
+    struct Counters
+    {
+        int commands;
+        int resets;
+        int launches;
+        int zeroCredits;
+        int withoutCredit;      // commands sent while the driver knew of no credit left
+        int maxOutstanding;     // commands sent and not answered yet
+        int polls;
+        int workloopStalls;     // synchronous requests given up on behind a blocked completion
+        int dropped;            // commands never answered, DROPPOLLS, DROPOP or WEDGEAFTER
+        double firstLaunch;
+        double endOfRecord;
+    };
+
+    // Asked for every command before the controller takes it, false counts it as sent without a credit
+    std::function<bool(const UInt8* command, UInt16 length)> creditCheck;
+
+    SimController()
+    {
+        mRoundTrip = harnessEnv("RTTUS", 1000) / 1000.0;
+        mService = harnessEnv("SERVICEUS", 100) / 1000.0;
+        mCredits = harnessEnv("CREDITS", 1);
+        mZeroCredit = harnessEnv("ZEROCREDIT", 0);
+        mReadyAfterReset = harnessEnv("READYRESET", 40);
+        mReadyAfterMiniDriver = harnessEnv("READYMINI", 30);
+        mVendorEvent = harnessEnv("VENDOR", 0) != 0;
+        mVendorDelay = harnessEnv("VENDORDELAY", 30);
+        mWorkloop = harnessEnv("WORKLOOP", 0) != 0;
+        mDropOpcode = getenv("DROPOP") ? (int)strtol(getenv("DROPOP"), NULL, 16) : -1;
+        mWedgeAfter = harnessEnv("WEDGEAFTER", 0);
+        mFirmwareBuild = harnessEnv("PATCHED", 0);
+        resetCounters();
+        mThread = std::thread([this]() { run(); });
+    }
+
+    ~SimController()
+    {
+        {
+            std::lock_guard<std::mutex> guard(mMutex);
+            mStopping = true;
+        }
+        mCondition.notify_all();
+        mThread.join();
+    }
+
+    void resetCounters()
+    {
+        std::lock_guard<std::mutex> guard(mMutex);
+        mCounters = Counters();
+        mOutstanding = 0;
+        mDropPolls = harnessEnv("DROPPOLLS", 0);
+        mDropCommands = harnessEnv("DROPN", 1);
+    }
+
+    Counters counters()
+    {
+        std::lock_guard<std::mutex> guard(mMutex);
+        return mCounters;
+    }
+
+    // Control transfer carrying an HCI command, returns once the controller has it
+    IOReturn command(const void* command, UInt16 length)
+    {
+        double sent = harnessMilliseconds();
+        bool credit = !creditCheck || creditCheck((const UInt8*)command, length);
+
+        usleep((useconds_t)(mRoundTrip * 500));
+
+        // up to 2 s, then the request times out like a USB request left on a stuck workloop
+        for (int i = 0; mWorkloop && mInCompletion && i < 2000; i++)
+            usleep(1000);
+
+        std::lock_guard<std::mutex> guard(mMutex);
+
+        if (mWorkloop && mInCompletion)
+        {
+            mCounters.workloopStalls++;
+            return kIOReturnTimeout;
+        }
+
+        execute((const UInt8*)command, length, sent, credit);
+        return kIOReturnSuccess;
+    }
+
+    // The same as an asynchronous request, completed once the controller has the command
+    IOReturn command(const void* command, UInt16 length, const USBCOMPLETION& completion)
+    {
+        bool credit = !creditCheck || creditCheck((const UInt8*)command, length);
+        std::lock_guard<std::mutex> guard(mMutex);
+        double sent = harnessMilliseconds();
+
+        execute((const UInt8*)command, length, sent, credit);
+        mWrites.push_back({ sent + mRoundTrip / 2, completion, NULL });
+        mCondition.notify_all();
+        return kIOReturnSuccess;
+    }
+
+    IOReturn read(IOMemoryDescriptor* buffer, const USBCOMPLETION& completion)
+    {
+        std::lock_guard<std::mutex> guard(mMutex);
+
+        for (const Transfer& read : mReads)
+        {
+            if (read.buffer == buffer)
+            {
+                fprintf(stderr, "read buffer queued twice\n");
+                abort();
+            }
+        }
+        mReads.push_back({ 0, completion, buffer });
+        mCondition.notify_all();
+        return kIOReturnSuccess;
+    }
+
+    IOReturn abortReads()
+    {
+        std::unique_lock<std::mutex> guard(mMutex);
+        std::deque<Transfer> reads;
+
+        reads.swap(mReads);
+        guard.unlock();
+
+        for (const Transfer& read : reads)
+            simComplete(read.completion, kIOReturnAborted, 0, (UInt32)read.buffer->getLength());
+        return kIOReturnSuccess;
+    }
+
+private:
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::thread mThread;
+    bool mStopping = false;
+
+    double mRoundTrip;
+    double mService;
+    int mCredits;
+    int mZeroCredit;
+    int mReadyAfterReset;
+    int mReadyAfterMiniDriver;
+    int mDropPolls;
+    int mDropOpcode;
+    int mDropCommands;
+    int mWedgeAfter;
+    int mFirmwareBuild;
+    bool mVendorEvent;
+    int mVendorDelay;
+    bool mWorkloop;
+    std::atomic<bool> mInCompletion{false};
+
+    double mBusyUntil = 0;
+    double mNoCreditsUntil = 0;
+    double mReadyAt = 0;
+    int mOutstanding;
+    Counters mCounters;
+
+    std::vector<Event> mEvents;
+    std::deque<Transfer> mWrites;
+    std::deque<Transfer> mReads;
+
+    // Executed in arrival order, the events leave once the command is done
+    double schedule(double sent)
+    {
+        mBusyUntil = std::max(sent + mRoundTrip / 2, mBusyUntil) + mService;
+        return mBusyUntil + mRoundTrip / 2;
+    }
+
+    void push(double due, std::vector<UInt8> data)
+    {
+        Event event = { due, std::move(data) };
+        mEvents.insert(std::upper_bound(mEvents.begin(), mEvents.end(), event, [](const Event& a, const Event& b) { return a.due < b.due; }), event);
+        mCondition.notify_all();
+    }
+
+    // Credits in an event leaving at due
+    UInt8 credits(double due)
+    {
+        return due < mNoCreditsUntil ? 0 : mCredits;
+    }
+
+    void commandComplete(double due, UInt16 opcode, UInt8 status, UInt8 credits)
+    {
+        push(due, { HCI_EVENT_COMMAND_COMPLETE, 4, credits, (UInt8)opcode, (UInt8)(opcode >> 8), status });
+    }
+
+    void commandStatus(double due, UInt16 opcode, UInt8 credits)
+    {
+        push(due, { HCI_EVENT_COMMAND_STATUS, 4, 0, credits, (UInt8)opcode, (UInt8)(opcode >> 8) });
+    }
+
+    void execute(const UInt8* command, UInt16 length, double sent, bool credit)
+    {
+        UInt16 opcode = OSReadLittleInt16(command, 0);
+        double due = schedule(sent);
+
+        mCounters.commands++;
+
+        if (!credit)
+            mCounters.withoutCredit++;
+
+        mOutstanding++;
+        mCounters.maxOutstanding = std::max(mCounters.maxOutstanding, mOutstanding);
+
+        // taken, but never answered
+        bool wedged = mWedgeAfter > 0 && mCounters.commands > mWedgeAfter;
+
+        if (wedged || (opcode == mDropOpcode && mDropCommands-- > 0))
+        {
+            mCounters.dropped++;
+            mOutstanding--;
+            return;
+        }
+
+        switch (opcode)
+        {
+            case HCI_OPCODE_RESET:
+                // events the controller has not sent yet are lost with the reset
+                mEvents.erase(std::remove_if(mEvents.begin(), mEvents.end(), [due](const Event& event) { return event.due > due; }), mEvents.end());
+                mCounters.resets++;
+                mReadyAt = mBusyUntil + mReadyAfterReset;
+                commandComplete(due, opcode, 0, credits(due));
+                break;
+
+            case HCI_OPCODE_DOWNLOAD_MINIDRIVER:
+                mReadyAt = mBusyUntil + mReadyAfterMiniDriver;
+                commandComplete(due, opcode, 0, credits(due));
+                break;
+
+            case HCI_OPCODE_LOCAL_VERSION:
+                mCounters.polls++;
+
+                if (mDropPolls > 0)
+                {
+                    mDropPolls--;
+                    mCounters.dropped++;
+                    mOutstanding--;
+                    break;
+                }
+                commandComplete(due, opcode, mBusyUntil >= mReadyAt ? 0 : 0x0c, credits(due));
+                break;
+
+            case HCI_OPCODE_READ_VERBOSE_CONFIG:
+            {
+                // firmware version 0 while the controller still runs its ROM
+                std::vector<UInt8> event = { HCI_EVENT_COMMAND_COMPLETE, 10, credits(due), (UInt8)opcode, (UInt8)(opcode >> 8), 0, 0, 0, 0, 0,
+                                             (UInt8)mFirmwareBuild, (UInt8)(mFirmwareBuild >> 8) };
+                push(due, event);
+                break;
+            }
+
+            case HCI_OPCODE_LAUNCH_RAM:
+                if (mCounters.launches++ == 0)
+                    mCounters.firstLaunch = harnessMilliseconds();
+
+                if (mZeroCredit > 0 && mCounters.launches % mZeroCredit == 0)
+                {
+                    mCounters.zeroCredits++;
+                    mNoCreditsUntil = due + 2;
+                    commandComplete(due, opcode, 0, 0);
+
+                    if (mZeroCredit & 1)
+                        commandComplete(due + 2, HCI_OPCODE_NOP, 0, mCredits);
+                    else
+                        commandStatus(due + 2, HCI_OPCODE_NOP, mCredits);
+                    break;
+                }
+                commandComplete(due, opcode, 0, credits(due));
+                break;
+
+            case HCI_OPCODE_END_OF_RECORD:
+                mCounters.endOfRecord = harnessMilliseconds();
+                commandComplete(due, opcode, 0, credits(due));
+
+                if (mVendorEvent)
+                    push(due + mVendorDelay, { HCI_EVENT_VENDOR, 1, 0 });
+                break;
+
+            default:
+                commandComplete(due, opcode, 0, credits(due));
+                break;
+        }
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> guard(mMutex);
+
+        while (!mStopping)
+        {
+            double now = harnessMilliseconds();
+
+            if (!mWrites.empty() && mWrites.front().due <= now)
+            {
+                Transfer write = mWrites.front();
+                mWrites.pop_front();
+
+                guard.unlock();
+                mInCompletion = true;
+                simComplete(write.completion, kIOReturnSuccess, 0, 0);
+                mInCompletion = false;
+                guard.lock();
+                continue;
+            }
+
+            if (!mReads.empty() && !mEvents.empty() && mEvents.front().due <= now)
+            {
+                Event event = mEvents.front();
+                Transfer read = mReads.front();
+                mEvents.erase(mEvents.begin());
+                mReads.pop_front();
+
+                // a NOP only returns credits and the vendor event is unsolicited, they answer no command
+                if (!(event.data[0] == HCI_EVENT_COMMAND_COMPLETE && OSReadLittleInt16(event.data.data(), 3) == HCI_OPCODE_NOP) &&
+                    event.data[0] != HCI_EVENT_COMMAND_STATUS && event.data[0] != HCI_EVENT_VENDOR)
+                    mOutstanding--;
+
+                memcpy(((IOBufferMemoryDescriptor*)read.buffer)->getBytesNoCopy(), event.data.data(), event.data.size());
+
+                guard.unlock();
+                mInCompletion = true;
+                simComplete(read.completion, kIOReturnSuccess, (UInt32)event.data.size(), (UInt32)read.buffer->getLength());
+                mInCompletion = false;
+                guard.lock();
+                continue;
+            }
+
+            // whatever gives the loop work notifies it, the timeout is only a safety net
+            double next = now + 100;
+
+            if (!mWrites.empty())
+                next = std::min(next, mWrites.front().due);
+            if (!mReads.empty() && !mEvents.empty())
+                next = std::min(next, mEvents.front().due);
+
+            mCondition.wait_for(guard, std::chrono::microseconds((long)std::max(0.0, (next - now) * 1000)));
+        }
+    }
+};
+
+#endif /* defined(__BrcmPatchRAM__SimController__) */
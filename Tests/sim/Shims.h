@@ -0,0 +1,241 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * USBDeviceShim, USBInterfaceShim and USBPipeShim on top of a simulated device,
+ * replacing USBDeviceShim.cpp/USBHostDeviceShim.cpp. Each SimDevice has its own
+ * controller, the interface and pipes found on it route every request there.
+ */
+
+#ifndef __BrcmPatchRAM__SimShims__
+#define __BrcmPatchRAM__SimShims__
+
+#include "Controller.h"
+
+#if defined(TARGET_ELCAPITAN) || defined(TARGET_CATALINA)
+typedef IOUSBHostDevice SimDeviceBase;
+typedef IOUSBHostInterface SimInterfaceBase;
+typedef IOUSBHostPipe SimPipeBase;
+#else
+typedef IOUSBDevice SimDeviceBase;
+typedef IOUSBInterface SimInterfaceBase;
+typedef IOUSBPipe SimPipeBase;
+#endif
+
+class SimDevice;
+
+class SimPipe : public SimPipeBase
+{
+public:
+    SimDevice* device = NULL;
+    UInt8 type = 0;
+};
+
+class SimInterface : public SimInterfaceBase
+{
+public:
+    SimDevice* device = NULL;
+    bool opened = false;
+};
+
+class SimDevice : public SimDeviceBase
+{
+public:
+    SimController controller;
+    SimInterface interface;
+    SimPipe interruptPipe;
+    SimPipe bulkPipe;
+    UInt16 vendorId;
+    UInt16 productId;
+    UInt8 configuration = 0;
+    std::atomic<bool> opened{false};
+
+    SimDevice(UInt16 vendor = 0x0a5c, UInt16 product = 0x21e8) : vendorId(vendor), productId(product)
+    {
+        interface.device = interruptPipe.device = bulkPipe.device = this;
+        interruptPipe.type = kUSBInterrupt;
+        bulkPipe.type = kUSBBulk;
+    }
+};
+
+// The firmware store is the only service the drivers look up
+static BrcmFirmwareStore* gSimFirmwareStore = NULL;
+
+IOService* IOService::waitForMatchingService(OSDictionary* matching, uint64_t timeout)
+{
+    if (gSimFirmwareStore)
+        gSimFirmwareStore->retain();
+    return gSimFirmwareStore;
+}
+
+static StandardUSB::ConfigurationDescriptor gSimConfiguration = { 1 };
+static StandardUSB::EndpointDescriptor gSimEndpoint = { 0x81 };
+
+// USBDeviceShim
+
+USBDeviceShim::USBDeviceShim() : m_pDevice(NULL) {}
+
+void USBDeviceShim::setDevice(IOService* provider)
+{
+    OSObject* previous = m_pDevice;
+
+    m_pDevice = OSDynamicCast(SimDevice, provider);
+
+    if (m_pDevice)
+        m_pDevice->retain();
+
+    if (previous)
+        previous->release();
+}
+
+static SimDevice* simDevice(IOService* device) { return (SimDevice*)device; }
+
+UInt16 USBDeviceShim::getVendorID() { return simDevice(m_pDevice)->vendorId; }
+UInt16 USBDeviceShim::getProductID() { return simDevice(m_pDevice)->productId; }
+OSObject* USBDeviceShim::getProperty(const char* name) { return m_pDevice->getProperty(name); }
+void USBDeviceShim::setProperty(const char* name, bool value) { m_pDevice->setProperty(name, value); }
+void USBDeviceShim::removeProperty(const char* name) { m_pDevice->removeProperty(name); }
+
+IOReturn USBDeviceShim::getStringDescriptor(UInt8 index, char* buf, int maxLen, UInt16 lang)
+{
+    snprintf(buf, maxLen, "Simulated %u", index);
+    return kIOReturnSuccess;
+}
+
+UInt16 USBDeviceShim::getDeviceRelease() { return 0x0112; }
+
+IOReturn USBDeviceShim::getDeviceStatus(IOService* forClient, USBStatus* status)
+{
+    *status = 0;
+    return kIOReturnSuccess;
+}
+
+IOReturn USBDeviceShim::resetDevice() { return kIOReturnSuccess; }
+UInt8 USBDeviceShim::getNumConfigurations() { return 1; }
+const USBCONFIGURATIONDESCRIPTOR* USBDeviceShim::getFullConfigurationDescriptor(UInt8 configIndex) { return (const USBCONFIGURATIONDESCRIPTOR*)&gSimConfiguration; }
+
+IOReturn USBDeviceShim::getConfiguration(IOService* forClient, UInt8* configNumber)
+{
+    *configNumber = simDevice(m_pDevice)->configuration;
+    return kIOReturnSuccess;
+}
+
+IOReturn USBDeviceShim::setConfiguration(IOService* forClient, UInt8 configValue, bool startInterfaceMatching)
+{
+    simDevice(m_pDevice)->configuration = configValue;
+    return kIOReturnSuccess;
+}
+
+bool USBDeviceShim::findFirstInterface(USBInterfaceShim* shim)
+{
+    shim->setInterface(&simDevice(m_pDevice)->interface);
+    return true;
+}
+
+// Exclusive like IOService::open, a second client is refused until close
+bool USBDeviceShim::open(IOService* forClient, IOOptionBits options, void* arg)
+{
+    bool opened = false;
+    return simDevice(m_pDevice)->opened.compare_exchange_strong(opened, true);
+}
+
+void USBDeviceShim::close(IOService* forClient, IOOptionBits options) { simDevice(m_pDevice)->opened = false; }
+
+UInt8 USBDeviceShim::getManufacturerStringIndex() { return 1; }
+UInt8 USBDeviceShim::getProductStringIndex() { return 2; }
+UInt8 USBDeviceShim::getSerialNumberStringIndex() { return 3; }
+
+// USBInterfaceShim
+
+USBInterfaceShim::USBInterfaceShim() : m_pInterface(NULL) {}
+
+void USBInterfaceShim::setInterface(IOService* interface) { m_pInterface = OSDynamicCast(SimInterface, interface); }
+
+static SimInterface* simInterface(IOService* interface) { return (SimInterface*)interface; }
+
+bool USBInterfaceShim::open(IOService* forClient, IOOptionBits options, void* arg)
+{
+    simInterface(m_pInterface)->opened = true;
+    return true;
+}
+
+void USBInterfaceShim::close(IOService* forClient, IOOptionBits options) { simInterface(m_pInterface)->opened = false; }
+
+#ifdef DEBUG
+UInt8 USBInterfaceShim::getInterfaceNumber() { return 0; }
+UInt8 USBInterfaceShim::getInterfaceClass() { return 0xe0; }
+UInt8 USBInterfaceShim::getInterfaceSubClass() { return 0x01; }
+UInt8 USBInterfaceShim::getInterfaceProtocol() { return 0x01; }
+#endif
+
+bool USBInterfaceShim::findPipe(USBPipeShim* shim, UInt8 type, UInt8 direction)
+{
+    SimDevice* device = simInterface(m_pInterface)->device;
+
+    shim->setPipe(type == kUSBInterrupt ? &device->interruptPipe : &device->bulkPipe);
+    return true;
+}
+
+IOReturn USBInterfaceShim::hciCommand(void* command, UInt16 length)
+{
+    return simInterface(m_pInterface)->device->controller.command(command, length);
+}
+
+#if defined(TARGET_ELCAPITAN) || defined(TARGET_CATALINA)
+IOReturn USBInterfaceShim::hciCommand(void* command, UInt16 length, USBCOMPLETION* completion)
+{
+    return simInterface(m_pInterface)->device->controller.command(command, length, *completion);
+}
+#endif
+
+// USBPipeShim
+
+USBPipeShim::USBPipeShim() : m_pPipe(NULL) {}
+
+void USBPipeShim::setPipe(OSObject* pipe) { m_pPipe = OSDynamicCast(SimPipe, pipe); }
+
+static SimPipe* simPipe(OSObject* pipe) { return (SimPipe*)pipe; }
+
+IOReturn USBPipeShim::abort()
+{
+    if (simPipe(m_pPipe)->type != kUSBInterrupt)
+        return kIOReturnSuccess;
+
+    return simPipe(m_pPipe)->device->controller.abortReads();
+}
+
+IOReturn USBPipeShim::read(IOMemoryDescriptor* buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, USBCOMPLETION* completion, IOByteCount* bytesRead)
+{
+    return simPipe(m_pPipe)->device->controller.read(buffer, *completion);
+}
+
+// Bulk writes carry the firmware records as HCI commands
+IOReturn USBPipeShim::write(IOMemoryDescriptor* buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, USBCOMPLETION* completion)
+{
+    SimController& controller = simPipe(m_pPipe)->device->controller;
+    UInt8 command[kEventMaxSize];
+    UInt16 length = (UInt16)buffer->readBytes(0, command, std::min<IOByteCount>(reqCount, sizeof(command)));
+
+    return completion ? controller.command(command, length, *completion) : controller.command(command, length);
+}
+
+const USBENDPOINTDESCRIPTOR* USBPipeShim::getEndpointDescriptor() { return (const USBENDPOINTDESCRIPTOR*)&gSimEndpoint; }
+IOReturn USBPipeShim::clearStall() { return kIOReturnSuccess; }
+
+#endif /* defined(__BrcmPatchRAM__SimShims__) */
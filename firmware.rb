@@ -1,6 +1,7 @@
 #!/usr/bin/ruby
 
 require 'base64'
+require 'digest'
 require 'fileutils'
 require 'optparse'
 require 'ostruct'
@@ -18,6 +19,186 @@ def add_key_value(dict, key, type, value)
   add_element(dict, type, value)
 end
 
+# Vendor Specific: Launch RAM
+HCI_VSC_LAUNCH_RAM = [ 0x4c, 0xfc ]
+
+# Pre-compiled patch stream header (see BrcmFirmwareStore.h)
+PATCH_STREAM_MAGIC = "BPRS"
+PATCH_STREAM_VERSION = 1
+PATCH_STREAM_HEADER_SIZE = 16
+
+# Firmware container header (see BrcmFirmwareStore.h)
+FIRMWARE_CONTAINER_MAGIC = "BPRZ"
+FIRMWARE_CONTAINER_VERSION = 1
+FIRMWARE_CONTAINER_HEADER_SIZE = 40
+FIRMWARE_CODEC_ZLIB = 1
+FIRMWARE_CODEC_LZ4 = 2
+FIRMWARE_CODEC_DELTA = 3
+FIRMWARE_DELTA_NAME_SIZE = 32
+FIRMWARE_DELTA_BLOCK = 16
+
+# Emit an LZ4 length continuation for lengths of 15 and above
+def lz4_length(out, length)
+  length -= 15
+  while length >= 255
+    out << 255
+    length -= 255
+  end
+  out << length
+end
+
+# Emit an LZ4 sequence: literals followed by an optional match
+def lz4_sequence(out, literals, offset = nil, match_length = 0)
+  match_extra = offset ? match_length - 4 : 0
+  out << ([ literals.size, 15 ].min << 4 | [ match_extra, 15 ].min)
+  lz4_length(out, literals.size) if literals.size >= 15
+  out.concat(literals)
+  return if !offset
+
+  out << (offset & 0xff) << (offset >> 8)
+  lz4_length(out, match_extra) if match_extra >= 15
+end
+
+# Compress data into a single LZ4 block (see lz4_decode in BrcmFirmwareStore.cpp)
+def lz4_compress(data)
+  bytes = data.bytes
+  out = Array.new
+  table = Hash.new
+  anchor = 0
+  i = 0
+
+  # LZ4 requires the last 5 bytes to be literals and the last match to start 12 bytes before the end
+  while i < bytes.size - 12
+    key = data.byteslice(i, 4)
+    candidate = table[key]
+    table[key] = i
+
+    if candidate && i - candidate <= 0xffff
+      length = 4
+      length += 1 while i + length < bytes.size - 5 && bytes[candidate + length] == bytes[i + length]
+
+      lz4_sequence(out, bytes[anchor...i], i - candidate, length)
+      (i + 1...i + length).each { |j| table[data.byteslice(j, 4)] = j } if i + length < bytes.size - 12
+      i += length
+      anchor = i
+    else
+      i += 1
+    end
+  end
+
+  lz4_sequence(out, bytes[anchor..-1])
+  out.pack("C*")
+end
+
+# Compress data with the requested codec and wrap it into a firmware container
+def compress_firmware(data, codec)
+  case codec
+  when "lz4"
+    pack_firmware(data, FIRMWARE_CODEC_LZ4, lz4_compress(data))
+  else
+    pack_firmware(data, FIRMWARE_CODEC_ZLIB, Zlib::Deflate.deflate(data, Zlib::BEST_COMPRESSION))
+  end
+end
+
+# Emit an unsigned LEB128 varint
+def delta_varint(out, value)
+  while value >= 0x80
+    out << (value & 0x7f | 0x80)
+    value >>= 7
+  end
+  out << value
+end
+
+# Encode data as insert/copy operations against a family base firmware (see BrcmFirmwareStore::decompressFirmwareDelta)
+def delta_encode(base, data)
+  index = Hash.new
+  (0..base.size - FIRMWARE_DELTA_BLOCK).each { |i| index[base.byteslice(i, FIRMWARE_DELTA_BLOCK)] ||= i }
+
+  out = Array.new
+  anchor = 0
+  i = 0
+
+  while i <= data.size - FIRMWARE_DELTA_BLOCK
+    offset = index[data.byteslice(i, FIRMWARE_DELTA_BLOCK)]
+    if !offset
+      i += 1
+      next
+    end
+
+    length = FIRMWARE_DELTA_BLOCK
+    length += 1 while i + length < data.size && offset + length < base.size && data.getbyte(i + length) == base.getbyte(offset + length)
+
+    delta_varint(out, i - anchor)
+    out.concat(data.byteslice(anchor...i).bytes)
+    delta_varint(out, offset)
+    delta_varint(out, length)
+
+    i += length
+    anchor = i
+  end
+
+  delta_varint(out, data.size - anchor)
+  out.concat(data.byteslice(anchor..-1).bytes)
+  delta_varint(out, 0)
+  delta_varint(out, 0)
+  out.pack("C*")
+end
+
+# Store data as a zlib compressed delta against the named family base
+def delta_firmware(data, base_name, base_data)
+  operations = delta_encode(base_data, data)
+  payload = [ base_name, Digest::SHA1.digest(base_data), operations.size ].pack("a#{FIRMWARE_DELTA_NAME_SIZE}a20V") + Zlib::Deflate.deflate(operations, Zlib::BEST_COMPRESSION)
+  pack_firmware(data, FIRMWARE_CODEC_DELTA, payload)
+end
+
+# Prefix compressed firmware with its uncompressed size, codec and payload digest
+def pack_firmware(data, codec, payload)
+  [ FIRMWARE_CONTAINER_MAGIC, FIRMWARE_CONTAINER_VERSION, FIRMWARE_CONTAINER_HEADER_SIZE, codec, data.size, payload.size ].pack("a4vvVVV") + Digest::SHA1.digest(payload) + payload
+end
+
+# Convert IntelHex firmware into the final LAUNCH_RAM commands, mirroring BrcmFirmwareStore::parseFirmware
+def compile_firmware(hex_data)
+  commands = Array.new
+  address = 0
+
+  hex_data.each_line do |line|
+    line = line.strip
+    next if line.empty?
+
+    if !line.start_with?(":")
+      raise "Invalid firmware data"
+    end
+
+    binary = [ line[1..-1] ].pack("H*").bytes
+    length = binary[0]
+    record_type = binary[3]
+
+    if binary[0, 5 + length].sum & 0xff != 0
+      raise "Invalid firmware, checksum mismatch"
+    end
+
+    case record_type
+    when 0 # Data
+      address = (address & 0xffff0000) | (binary[1] << 8 | binary[2])
+      commands << (HCI_VSC_LAUNCH_RAM + [ length + 4 ] + [ address ].pack("V").bytes + binary[4, length]).pack("C*")
+    when 1 # End of File
+      break
+    when 2 # Extended Segment Address
+      address = (binary[4] << 8 | binary[5]) << 4
+    when 4 # Extended Linear Address
+      address = binary[4] << 24 | binary[5] << 16
+    else
+      raise "Invalid firmware, unsupported record type 0x%02x" % record_type
+    end
+  end
+
+  offsets = Array.new
+  commands.inject(0) { |offset, command| offsets << offset; offset + command.size }
+  data = commands.join
+
+  [ PATCH_STREAM_MAGIC, PATCH_STREAM_VERSION, PATCH_STREAM_HEADER_SIZE, commands.size, data.size ].pack("a4vvVV") + data + offsets.pack("V*")
+end
+
 def parse_inf(inf_path)
   devices = Array.new
   in_device_block = 0
@@ -101,7 +282,7 @@ def parse_inf(inf_path)
   return devices
 end
 
-def create_firmwares(devices, input_path, output_path)
+def create_firmwares(devices, input_path, output_path, options)
   # Create output folder
   FileUtils::makedirs output_path
   FileUtils::chdir output_path
@@ -112,6 +293,29 @@ def create_firmwares(devices, input_path, output_path)
   rescue
   end
 
+  # Store one base firmware (the latest) per chip family, the others become deltas against it
+  bases = Hash.new
+  if options.delta
+    families = Hash.new { |hash, key| hash[key] = Array.new }
+    Dir.glob(File.join(input_path, "*.hex")).each do |firmware|
+      device = devices.find { |d| d.firmware != nil && d.firmware.casecmp(File.basename(firmware)) == 0 }
+      families[File.basename(firmware).split("_").first.upcase] << [ device.firmwareVersion.to_i, firmware ] if device
+    end
+
+    families.each do |family, firmwares|
+      next if firmwares.map { |f| f[1] }.uniq.size < 2
+
+      base_name = "#{family}_base"
+      base_data = File.read(firmwares.max[1])
+      base_data = compile_firmware(base_data) if options.compile
+      base_compressed = compress_firmware(base_data, options.codec)
+      File.write(File.join(output_path, "#{base_name}.zhx"), base_compressed)
+      bases[family] = [ base_name, base_data, base_compressed ]
+
+      puts "Created base firmware #{base_name}.zhx (#{base_data.size} --> #{base_compressed.size})"
+    end
+  end
+
   # Prune and rename existing firmwares
   Dir.glob(File.join(input_path, "*.hex")).each do |firmware|
     basename = File.basename(firmware)
@@ -122,7 +326,9 @@ def create_firmwares(devices, input_path, output_path)
     if device  
       output_file = "#{File.basename(firmware, File.extname(firmware))}_v#{device.firmwareVersion}.zhx"
       data_to_compress = File.read(firmware)
-      data_compressed = Zlib::Deflate.deflate(data_to_compress, Zlib::BEST_COMPRESSION)
+      data_to_compress = compile_firmware(data_to_compress) if options.compile
+      base = bases[basename.split("_").first.upcase]
+      data_compressed = base ? delta_firmware(data_to_compress, base[0], base[1]) : compress_firmware(data_to_compress, options.codec)
     
       puts "Compressed firmware #{output_file} (#{data_to_compress.size} --> #{data_compressed.size})"
     
@@ -141,15 +347,15 @@ def create_firmwares(devices, input_path, output_path)
         FileUtils::symlink("./" + File.join(device_folder, File.basename(latest_firmware)), File.basename(latest_firmware))
       end
       
-      create_injector(device, false, data_compressed, device_path)
-      create_injector(device, true, data_compressed, device_path)
+      create_injector(device, false, data_compressed, device_path, base)
+      create_injector(device, true, data_compressed, device_path, base)
     else
       puts "Firmware file %s is not matched against devices in INF file... skipping." % basename
     end
   end
 end
 
-def create_injector(device, for_usbhost, compressed_data, output_path)
+def create_injector(device, for_usbhost, compressed_data, output_path, base = nil)
   xml = Document.new('<?xml version="1.0" encoding="UTF-8"?><!DOCTYPE plist PUBLIC "-//Apple//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd"><plist version="1.0"/>');
   
   root_dict = Element.new("dict", xml.root)
@@ -185,6 +391,7 @@ def create_injector(device, for_usbhost, compressed_data, output_path)
   
   firmwares_dict = Element.new("dict", firmware_dict)
   add_key_value(firmwares_dict,  "%04x_%04x_v%4d" % [ device.vendorId, device.productId, device.firmwareVersion ], "data", Base64.encode64(compressed_data))
+  add_key_value(firmwares_dict, base[0], "data", Base64.encode64(base[2])) if base
   
   add_key_value(firmware_dict, "IOClass", "string", "BrcmFirmwareStore")
   add_key_value(firmware_dict, "IOMatchCategory", "string", "BrcmFirmwareStore")
@@ -274,24 +481,49 @@ def create_readme(devices, output_path)
   end
 end
 
-if ARGV.length != 2
-  puts "Usage: firmware.rb <input folder> <output folder>"
-  exit
-end
+# Only run when invoked directly, Tests/fixtures.rb loads the encoders above
+if __FILE__ == $0
+  options = OpenStruct.new
+  options.compile = false
+  options.codec = "zlib"
+  options.delta = false
+
+  parser = OptionParser.new do |opts|
+    opts.banner = "Usage: firmware.rb [options] <input folder> <output folder>"
+
+    opts.on("-c", "--compile", "Store pre-compiled LAUNCH_RAM patch streams instead of IntelHex") do
+      options.compile = true
+    end
 
-input = File.expand_path(ARGV.shift)
-output = File.expand_path(ARGV.shift)
+    opts.on("--codec CODEC", [ "zlib", "lz4" ], "Compress firmwares with zlib (default, smallest) or lz4 (fastest to decode)") do |codec|
+      options.codec = codec
+    end
 
-# Parse Windows INF file into device objects
-devices = parse_inf(File.join(input, "bcbtums.inf"))
+    opts.on("-d", "--delta", "Store firmwares of a chip family as deltas against a shared base firmware") do
+      options.delta = true
+    end
+  end
+  parser.parse!
 
-# Extract and compress all device firmwares
-create_firmwares(devices, input, output)
+  if ARGV.length != 2
+    puts parser.banner
+    exit
+  end
 
-# Generate plist extract
-create_plist(devices, output, 1)
-create_plist(devices, output, 2)
-create_plist(devices, output, 3)
+  input = File.expand_path(ARGV.shift)
+  output = File.expand_path(ARGV.shift)
 
-# Generate markdown readme with device / firmware information
-create_readme(devices, output)
+  # Parse Windows INF file into device objects
+  devices = parse_inf(File.join(input, "bcbtums.inf"))
+
+  # Extract and compress all device firmwares
+  create_firmwares(devices, input, output, options)
+
+  # Generate plist extract
+  create_plist(devices, output, 1)
+  create_plist(devices, output, 2)
+  create_plist(devices, output, 3)
+
+  # Generate markdown readme with device / firmware information
+  create_readme(devices, output)
+end
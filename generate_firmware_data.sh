@@ -4,6 +4,9 @@ out="GeneratedFirmwares.cpp"
 cksum="GeneratedFirmwaresMD5.txt"
 cksum_temp="/tmp/$(uuidgen)_GeneratedFirmwareMD5.txt"
 
+# Firmwares are emitted in strcmp order, lookupFirmware binary searches the table
+export LC_ALL=C
+
 firmwaredir=./firmwares
 firmwares=$firmwaredir/*.zhx
 
@@ -14,6 +17,8 @@ if [[ "$1" == "clean" ]]; then
 fi
 
 if [ -e $cksum_temp ]; then rm $cksum_temp; fi
+# Bump when the generated table layout changes
+echo "format 2" >$cksum_temp
 for firmware in $firmwares; do
     echo "`basename $firmware` `md5 -q $firmware`" >>$cksum_temp
 done
@@ -52,7 +57,6 @@ for firmware in $firmwares; do
     cname=${fname//./_}
     echo "    { \"${fname}\", ${cname}, sizeof(${cname}), },">>$out
 done
-echo "    { NULL, NULL, 0, },">>$out
 echo "};">>$out
 
 cp $cksum_temp $cksum